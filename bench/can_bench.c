@@ -0,0 +1,174 @@
+/*
+ * Standalone microbenchmark for the hot paths of the port process:
+ * parse_can_frame, encode_can_frame and can_read_into_buffer.
+ *
+ * can_read_into_buffer is driven through a nonblocking AF_UNIX datagram
+ * socketpair so it can run without a CAN interface. Each datagram is one
+ * struct can_frame, which is exactly what a CAN_RAW socket hands back.
+ *
+ * Results are printed as one JSON object per line so runs can be diffed
+ * between releases.
+ *
+ * Usage: can_bench [-n iterations] [-b batch_size]
+ */
+
+#include "../src/can_port.h"
+#include "../src/util.h"
+#include "../src/erlcmd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define DEFAULT_ITERATIONS 10000
+#define DEFAULT_BATCH 100
+#define MAX_BATCH 1000
+
+static uint64_t now_ns()
+{
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return ((uint64_t) tp.tv_sec) * 1000000000ULL + tp.tv_nsec;
+}
+
+static void report(const char *name, long iterations, int batch, uint64_t elapsed_ns)
+{
+  double frames = (double) iterations * batch;
+  printf("{\"bench\":\"%s\",\"iterations\":%ld,\"batch\":%d,"
+         "\"elapsed_ns\":%llu,\"ns_per_frame\":%.2f,\"frames_per_sec\":%.0f}\n",
+         name, iterations, batch, (unsigned long long) elapsed_ns,
+         elapsed_ns / frames, frames * 1e9 / elapsed_ns);
+  fflush(stdout);
+}
+
+static void fill_frame(struct can_frame *can_frame, int i)
+{
+  memset(can_frame, 0, sizeof(*can_frame));
+  can_frame->can_id = 0x100 + (i & 0x3ff);
+  can_frame->can_dlc = 8;
+  for (int j = 0; j < 8; j++)
+    can_frame->data[j] = (unsigned char) (i + j);
+}
+
+static void bench_encode(long iterations, int batch)
+{
+  char *buffer = malloc(36 + (MAX_BATCH * ENCODED_READ_FRAME_SIZE));
+  struct can_frame can_frame;
+  fill_frame(&can_frame, 1);
+
+  uint64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    int index = 0;
+    for (int j = 0; j < batch; j++)
+      encode_can_frame(buffer, &index, &can_frame);
+  }
+  report("encode_can_frame", iterations, batch, now_ns() - start);
+  free(buffer);
+}
+
+static void bench_parse(long iterations, int batch)
+{
+  // Same layout handle_write receives: a list of {id, <<8 bytes>>} tuples
+  char *req = malloc(16 + (MAX_BATCH * ENCODED_WRITE_FRAME_SIZE));
+  int req_len = 0;
+  ei_encode_list_header(req, &req_len, batch);
+  for (int j = 0; j < batch; j++) {
+    struct can_frame can_frame;
+    fill_frame(&can_frame, j);
+    ei_encode_tuple_header(req, &req_len, 2);
+    ei_encode_ulong(req, &req_len, can_frame.can_id);
+    ei_encode_binary(req, &req_len, can_frame.data, 8);
+  }
+  ei_encode_empty_list(req, &req_len);
+
+  volatile canid_t sink = 0;
+  uint64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    int index = 0;
+    int num_frames;
+    ei_decode_list_header(req, &index, &num_frames);
+    for (int j = 0; j < num_frames; j++)
+      sink ^= parse_can_frame(req, &index).can_id;
+  }
+  report("parse_can_frame", iterations, batch, now_ns() - start);
+  free(req);
+}
+
+static void bench_read(long iterations, int batch)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0)
+    err(EXIT_FAILURE, "socketpair");
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(sv[i], F_GETFL, 0);
+    fcntl(sv[i], F_SETFL, flags | O_NONBLOCK);
+  }
+  int sndbuf = 4 * 1024 * 1024;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &sndbuf, sizeof(sndbuf));
+
+  struct can_port *can_port;
+  can_init(&can_port);
+  can_port->fd = sv[1];
+
+  struct can_frame can_frame;
+  fill_frame(&can_frame, 1);
+
+  uint64_t elapsed = 0;
+  long frames_read = 0;
+  for (long i = 0; i < iterations; i++) {
+    for (int j = 0; j < batch; j++) {
+      if (write(sv[0], &can_frame, sizeof(can_frame)) < 0)
+        err(EXIT_FAILURE, "socketpair write (batch too large for socket buffer?)");
+    }
+
+    int resp_index = 0;
+    uint64_t start = now_ns();
+    int num_read = can_read_into_buffer(can_port, &resp_index, MAX_NOTIFY_FRAMES);
+    elapsed += now_ns() - start;
+
+    if (num_read < 0)
+      err(EXIT_FAILURE, "can_read_into_buffer");
+    frames_read += num_read;
+  }
+  if (frames_read != iterations * batch)
+    errx(EXIT_FAILURE, "read %ld frames, expected %ld", frames_read, iterations * batch);
+
+  report("can_read_into_buffer", iterations, batch, elapsed);
+
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(int argc, char *argv[])
+{
+  long iterations = DEFAULT_ITERATIONS;
+  int batch = DEFAULT_BATCH;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = strtol(optarg, NULL, 0);
+      break;
+    case 'b':
+      batch = (int) strtol(optarg, NULL, 0);
+      break;
+    default:
+      errx(EXIT_FAILURE, "usage: %s [-n iterations] [-b batch_size]", argv[0]);
+    }
+  }
+  if (iterations <= 0 || batch <= 0 || batch > MAX_BATCH)
+    errx(EXIT_FAILURE, "iterations must be > 0 and batch must be in 1..%d", MAX_BATCH);
+
+  bench_encode(iterations, batch);
+  bench_parse(iterations, batch);
+  bench_read(iterations, batch);
+
+  return 0;
+}
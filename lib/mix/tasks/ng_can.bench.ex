@@ -0,0 +1,249 @@
+defmodule Mix.Tasks.NgCan.Bench do
+  use Mix.Task
+  use Bitwise
+
+  @shortdoc "Measures Ng.Can throughput and latency on a vcan interface"
+
+  @moduledoc """
+  Drives a (v)can interface through two `Ng.Can` ports and reports
+  throughput, end-to-end latency, CPU cost and drops, along with the
+  drop counters from `Ng.Can.stats/1` that say where frames were lost.
+
+      mix ng_can.bench --interface vcan0 --rate 5000 --batch 10 --duration 10
+
+  Options:
+
+    * `--interface` - interface to use, defaults to `vcan0`
+    * `--rate` - frames/sec to offer, `0` (the default) writes as fast as possible
+    * `--batch` - frames per `Ng.Can.write/2` call, defaults to 10. Keep
+      this under ~500 so a batch fits in one port command.
+    * `--duration` - seconds to send for, defaults to 5
+    * `--rcvbuf` / `--sndbuf` - socket buffer sizes passed to `Ng.Can.open/3`
+    * `--threaded` - open the reader with `threaded: true`
+    * `--ring-size` - frames buffered between threads in threaded mode
+    * `--coalesce` / `--coalesce-us` - the reader's `:coalesce` frame and
+      time limits
+    * `--rt-priority`, `--cpu`, `--lock-memory`, `--busy-poll` - run the
+      reader's port process with these `:realtime` options (priority,
+      CPU, mlockall, busy-poll microseconds). Compare p99 latency with and
+      without them; the priority and memory locking need root.
+    * `--output` - also write the JSON result to this file
+
+  The writer and reader share the interface, so this relies on the default
+  CAN_RAW_LOOPBACK behaviour. Each frame carries its send time in the
+  payload; latency is measured from just before `Ng.Can.write/2` until the
+  frame is delivered to the reading process.
+
+  The result is printed as a single JSON object so runs can be compared
+  between releases.
+  """
+
+  @switches [interface: :string, rate: :integer, batch: :integer,
+             duration: :integer, rcvbuf: :integer, sndbuf: :integer,
+             threaded: :boolean, ring_size: :integer, coalesce: :integer,
+             coalesce_us: :integer, rt_priority: :integer, cpu: :integer,
+             lock_memory: :boolean, busy_poll: :integer, output: :string]
+
+  #how long the reader waits for stragglers after the writer is done
+  @drain_timeout 1000
+
+  def run(args) do
+    {opts, _, _} = OptionParser.parse(args, switches: @switches)
+    Mix.Task.run("app.start")
+
+    interface = opts[:interface] || "vcan0"
+    rate = opts[:rate] || 0
+    batch = opts[:batch] || 10
+    duration_ms = (opts[:duration] || 5) * 1000
+    open_args = Keyword.take(opts, [:rcvbuf, :sndbuf])
+    reader_args = if opts[:threaded],
+      do: [{:threaded, [ring_size: opts[:ring_size]]} | open_args],
+      else: open_args
+    reader_args = if opts[:coalesce],
+      do: [{:coalesce, [frames: opts[:coalesce], timeout_us: opts[:coalesce_us]]} | reader_args],
+      else: reader_args
+    realtime = [priority: opts[:rt_priority], cpu: opts[:cpu],
+                lock_memory: opts[:lock_memory], busy_poll_us: opts[:busy_poll]]
+    reader_args = [{:realtime, realtime} | reader_args]
+
+    {:ok, writer} = Ng.Can.start_link()
+    :ok = Ng.Can.open(writer, interface, open_args)
+    bench = self()
+    reader_task = Task.async(fn -> reader(bench, interface, reader_args) end)
+    reader = receive do
+      {:reader_ready, pid} -> pid
+    end
+
+    t0 = System.monotonic_time(:nanosecond)
+    cpu_before = cpu_sample([writer, reader])
+
+    sent = send_frames(writer, t0, rate, batch, duration_ms)
+    send_elapsed_ns = System.monotonic_time(:nanosecond) - t0
+
+    send(reader_task.pid, {:done_sending, sent})
+    {received, latencies} = Task.await(reader_task, duration_ms + 30_000)
+    cpu_after = cpu_sample([writer, reader])
+    {:ok, writer_stats} = Ng.Can.stats(writer)
+    {:ok, reader_stats} = Ng.Can.stats(reader)
+
+    result = report(%{
+      interface: interface,
+      offered_rate: rate,
+      batch: batch,
+      duration_ms: duration_ms,
+      sent: sent,
+      received: received,
+      send_elapsed_ns: send_elapsed_ns,
+      threaded: opts[:threaded] == true,
+      rt_priority: opts[:rt_priority] || 0,
+      cpu: opts[:cpu] || -1,
+      lock_memory: opts[:lock_memory] == true,
+      busy_poll_us: opts[:busy_poll] || 0,
+      rx_kernel_drops: reader_stats.rx_kernel_drops,
+      rx_ring_overflows: reader_stats.rx_ring_overflows,
+      rcvbuf_drops: reader_stats.rcvbuf_drops,
+      tx_retries: writer_stats.tx_retries,
+      tx_dropped: writer_stats.tx_dropped,
+      tx_rejected: writer_stats.tx_rejected,
+      notifications: reader_stats.notifications,
+      coalesce_timeouts: reader_stats.coalesce_timeouts,
+      busy_poll_hits: reader_stats.busy_poll_hits
+    }, latencies, cpu_before, cpu_after)
+
+    json = encode_json(result)
+    IO.puts json
+    if opts[:output], do: File.write!(opts[:output], json <> "\n")
+  end
+
+  defp send_frames(writer, t0, rate, batch, duration_ms) do
+    deadline = t0 + duration_ms * 1_000_000
+    send_loop(writer, t0, deadline, rate, batch, 0)
+  end
+
+  defp send_loop(writer, t0, deadline, rate, batch, sent) do
+    now = System.monotonic_time(:nanosecond)
+    if now >= deadline do
+      sent
+    else
+      #catch up on every batch that is due so pacing doesn't drift
+      due = if rate > 0, do: div((now - t0) * rate, 1_000_000_000), else: sent + batch
+      sent = write_due(writer, t0, batch, sent, due)
+      if rate > 0, do: Process.sleep(1)
+      send_loop(writer, t0, deadline, rate, batch, sent)
+    end
+  end
+
+  defp write_due(writer, t0, batch, sent, due) when sent < due do
+    #absolute monotonic time, so the reader needs no shared reference point
+    ts = System.monotonic_time(:nanosecond)
+    frames = Enum.map(sent..(sent + batch - 1), fn seq ->
+      #extended id carries the sequence number, payload the send time
+      {0x80000000 ||| (seq &&& 0x1FFFFFFF), <<ts::signed-64>>}
+    end)
+    #frames that didn't fit in the tx queue were never sent; back off
+    #until the next round instead of spinning on a full queue
+    case Ng.Can.write(writer, frames) do
+      :ok -> write_due(writer, t0, batch, sent + batch, due)
+      {:error, {:tx_queue_full, rejected}} -> sent + batch - rejected
+    end
+  end
+  defp write_due(_writer, _t0, _batch, sent, _due), do: sent
+
+  defp reader(bench, interface, open_args) do
+    {:ok, reader} = Ng.Can.start_link()
+    #frames are delivered to the process that opened the port
+    :ok = Ng.Can.open(reader, interface, open_args)
+    send(bench, {:reader_ready, reader})
+    read_loop(reader, nil, 0, [])
+  end
+
+  defp read_loop(reader, expected, received, latencies) do
+    if expected != nil and received >= expected do
+      {received, latencies}
+    else
+      :ok = Ng.Can.await_read(reader)
+      timeout = if expected == nil, do: :infinity, else: @drain_timeout
+      receive do
+        {:can_frames, _, frames} ->
+          now = System.monotonic_time(:nanosecond)
+          latencies = Enum.reduce(frames, latencies, fn
+            {_id, <<ts::signed-64>>}, acc -> [now - ts | acc]
+            _other, acc -> acc
+          end)
+          read_loop(reader, expected, received + length(frames), latencies)
+        {:done_sending, sent} ->
+          read_loop(reader, sent, received, latencies)
+      after
+        timeout -> {received, latencies}
+      end
+    end
+  end
+
+  defp report(result, latencies, cpu_before, cpu_after) do
+    sorted = latencies |> Enum.sort() |> List.to_tuple()
+    port_cpu_us = cpu_after.port_us - cpu_before.port_us
+    beam_cpu_us = cpu_after.beam_us - cpu_before.beam_us
+    per_frame = fn us -> if result.received > 0, do: us / result.received, else: nil end
+
+    Map.merge(result, %{
+      frames_per_sec: result.received * 1_000_000_000 / max(result.send_elapsed_ns, 1),
+      dropped: result.sent - result.received,
+      latency_us_p50: percentile(sorted, 0.5),
+      latency_us_p99: percentile(sorted, 0.99),
+      latency_us_p999: percentile(sorted, 0.999),
+      latency_us_max: percentile(sorted, 1.0),
+      port_cpu_us_per_frame: per_frame.(port_cpu_us),
+      beam_cpu_us_per_frame: per_frame.(beam_cpu_us)
+    })
+  end
+
+  defp percentile({}, _q), do: nil
+  defp percentile(sorted, q) do
+    n = tuple_size(sorted)
+    elem(sorted, min(n - 1, trunc(q * n))) / 1000
+  end
+
+  #CPU time of the port executables (from /proc) and of the whole BEAM
+  defp cpu_sample(can_pids) do
+    port_us = Enum.reduce(can_pids, 0, fn pid, acc ->
+      {:os_pid, os_pid} = Port.info(:sys.get_state(pid).port, :os_pid)
+      acc + proc_cpu_us(os_pid)
+    end)
+    {beam_ms, _} = :erlang.statistics(:runtime)
+    %{port_us: port_us, beam_us: beam_ms * 1000}
+  end
+
+  defp proc_cpu_us(os_pid) do
+    case File.read("/proc/#{os_pid}/stat") do
+      {:ok, stat} ->
+        #skip past the executable name, which may contain spaces
+        [_, rest] = String.split(stat, ") ", parts: 2)
+        fields = String.split(rest)
+        utime = fields |> Enum.at(11) |> String.to_integer()
+        stime = fields |> Enum.at(12) |> String.to_integer()
+        div((utime + stime) * 1_000_000, clock_ticks())
+      {:error, _} ->
+        0
+    end
+  end
+
+  defp clock_ticks do
+    case Integer.parse(to_string(:os.cmd('getconf CLK_TCK'))) do
+      {ticks, _} when ticks > 0 -> ticks
+      _ -> 100
+    end
+  end
+
+  defp encode_json(map) do
+    fields = map
+      |> Enum.sort()
+      |> Enum.map_join(",", fn {k, v} -> "\"#{k}\":#{encode_json_value(v)}" end)
+    "{" <> fields <> "}"
+  end
+
+  defp encode_json_value(nil), do: "null"
+  defp encode_json_value(v) when is_float(v), do: :erlang.float_to_binary(v, decimals: 3)
+  defp encode_json_value(v) when is_integer(v), do: Integer.to_string(v)
+  defp encode_json_value(v) when is_boolean(v), do: Atom.to_string(v)
+  defp encode_json_value(v) when is_binary(v), do: inspect(v)
+end
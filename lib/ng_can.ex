@@ -1,5 +1,6 @@
 defmodule Ng.Can do
   use GenServer
+  use Bitwise
   require Logger
   @moduledoc """
   Documentation for NgCan.
@@ -8,15 +9,52 @@ defmodule Ng.Can do
   #keep up to 1000 can frames in state, serve up to 100 at a time
   @rcv_bufsize 1000
   @rcv_chunksize 100
+  #transmit priority classes, highest first
+  @tx_classes [:high, :normal, :bulk]
+  @default_tx_queue [depth: 1000, policy: :reject]
+  #with tx_queues, keep the kernel's FIFO short so frames wait in the port's
+  #priority queues instead of ahead of every later :high frame
+  @tx_queued_txqueuelen 10
+  #only the last this many writes with confirm: are waited for, older ones are forgotten
+  @max_pending_confirms 4096
+  @default_ring_size 4096
+  @default_coalesce_us 1000
+  #J1939 "no name" / "no address"; 0xFF is also the broadcast address
+  @j1939_no_name 0
+  @j1939_no_addr 0xFF
+  @j1939_default_priority 6
+  @j1939_pgn_max 0x3FFFF
+  #CPU_SETSIZE - 1
+  @max_cpu 1023
+  @default_recorder [capacity: 100_000, pre_ms: 5000, post_ms: 1000, triggers: []]
+  #set in the id of extended frames, as the kernel reports them
+  @can_eff_flag 0x80000000
   defmodule State do
     defstruct [
       port: nil,
       awaiting_process: nil,
       awaiting_read: false,
       interface: nil,
+      #:raw or :j1939, decides what frames the port delivers
+      mode: :raw,
       #new frames are added to the front of the list
       rcvbuf: [],
-      rcvbuf_len: 0
+      rcvbuf_len: 0,
+      #frames trimmed from rcvbuf because nobody read them in time
+      rcvbuf_drops: 0,
+      stats_interval: nil,
+      #ref of the running :emit_stats timer, stale ones are ignored
+      stats_timer: nil,
+      tx_confirm: false,
+      confirm_seq: 0,
+      #confirm_seq => {pid, tag, mode, frames accepted}
+      confirms: %{},
+      #seqs added to confirms, oldest first, and how many there are
+      confirm_order: :queue.new(),
+      confirm_order_len: 0,
+      #chunks of the flight recording being received, newest first
+      recording: [],
+      recorder_file: nil
     ]
   end
 
@@ -28,21 +66,261 @@ defmodule Ng.Can do
     GenServer.start(__MODULE__, [], opts)
   end
 
-  def write(pid, frames) when is_list(frames) do
-    GenServer.call(pid, {:write, pad_to_8_bytes(frames)})
+  @doc """
+  Writes a frame or a list of frames.
+
+  Frames the socket can't take right away are queued in the port by
+  priority class and sent highest class first, so a long `:bulk` transfer
+  doesn't hold up `:high` frames written after it. Pass `class: :high`,
+  `:normal` (the default) or `:bulk`; queue depths are set with the
+  `:tx_queues` option to `open/3`.
+
+  If the port was opened with `tx_confirm: true`, pass `confirm: tag` to
+  be told when the frames actually went out on the bus. The calling
+  process receives `{:can_tx_confirmed, interface, tag, timestamp_ns}`
+  once the last frame has been sent, or with `confirm_mode: :frame`, a
+  `{:can_tx_confirmed, interface, {tag, index}, timestamp_ns}` for each
+  frame. The timestamp is the kernel's `CLOCK_REALTIME` in ns since the
+  epoch, taken when the controller handed the frame back as sent, so it
+  can be compared with `System.os_time(:nanosecond)`. Frames discarded from a full
+  `:drop_oldest` queue are never confirmed.
+
+  Returns `:ok`, `{:error, {:tx_queue_full, n}}` if the last `n` frames
+  didn't fit in a queue with the `:reject` policy, or `{:error, :einval}`
+  for an unknown `:class`.
+  """
+  def write(pid, frames, opts \\ [])
+  def write(pid, frames, opts) when is_list(frames) do
+    case Enum.find_index(@tx_classes, &(&1 == (opts[:class] || :normal))) do
+      nil ->
+        {:error, :einval}
+      tx_class ->
+        confirm = if Keyword.has_key?(opts, :confirm),
+          do: {opts[:confirm], opts[:confirm_mode] || :batch}
+        GenServer.call(pid, {:write, tx_class, pad_to_8_bytes(frames), confirm})
+    end
   end
-  def write(pid, frames) do
-    write(pid, [frames])
+  def write(pid, frames, opts) do
+    write(pid, [frames], opts)
   end
 
+  @doc """
+  Opens the CAN interface `name`. The process calling `open` receives the
+  frames requested with `await_read/1`.
+
+  Options:
+
+    * `:rcvbuf` / `:sndbuf` - socket buffer sizes in bytes
+    * `:stats_interval` - emit `[:ng_can, :stats]` telemetry every this many ms
+    * `:on_change` - only deliver a frame when its payload differs from the
+      last one delivered for the same id. `true`, or a keyword list with
+      `:refresh` (ms after which an unchanged frame is delivered anyway,
+      defaults to never) and `:masks`, a list of `{id, mask}` where only
+      the bits set in `mask` count as a change (e.g. to ignore rolling
+      counters and checksums). Short masks are padded with `0xFF`, and
+      ids above `0x7FF` match extended frames. Up to 256 masks; ones over
+      8 bytes make `open/3` return `{:error, :einval}`.
+    * `:decimate` - decimation rules, see `set_decimation/2`
+    * `:tx_queues` - depth limit and full-queue policy per `write/3` class,
+      e.g. `[high: [depth: 64, policy: :drop_oldest], bulk: [depth: 4096]]`.
+      `:policy` is `:reject` (the default) or `:drop_oldest`; the default
+      depth is 1000. Anything else makes `open/3` return `{:error, :einval}`.
+      Frames already handed to the kernel aren't reordered, so with this
+      option the interface's `txqueuelen` is lowered from 1000 to 10.
+    * `:tx_confirm` - report when written frames leave the controller, see
+      `write/3`
+    * `:threaded` - read the socket on a dedicated thread in the port, so a
+      slow BEAM (e.g. during GC) can't stall reception and overflow the
+      kernel's receive queue. `true`, or `[ring_size: n]` to set how many
+      frames (default 4096, at most 1048576) can be buffered between the
+      threads. Frames that don't fit are counted as `rx_ring_overflows` in
+      `stats/1`.
+    * `:coalesce` - deliver received frames in fewer, larger batches.
+      `[frames: n, timeout_us: t]` holds frames in the port until `n` are
+      buffered or `t` microseconds (default 1000) have passed since the
+      first one, trading up to `t` of latency for fewer messages. The
+      default, `frames: 1`, delivers whatever each read of the socket
+      returns straight away.
+    * `:recorder` - keep recent frames in the port and dump them when
+      something goes wrong, see `trigger_recording/1`
+    * `:realtime` - run the port process with lower wakeup latency, see
+      `set_realtime/2`. Parts that can't be applied are logged and skipped.
+  """
   def open(pid, name, args \\[]) do
     GenServer.call(pid, {:open, name, args})
   end
 
+  @doc """
+  Changes how the port process is scheduled. Options:
+
+    * `:priority` - run at this `SCHED_FIFO` priority (1-99), or `0` for
+      the normal scheduler
+    * `:cpu` - pin the process to this CPU, or `:any` to unpin it
+    * `:lock_memory` - `true` to lock the process's memory with `mlockall`
+      and touch its stack up front, so the receive path never waits on a
+      page fault; `false` to unlock it
+    * `:busy_poll_us` - after each wakeup, keep checking the socket
+      without sleeping for up to this many microseconds, `0` to never.
+      This costs a spinning CPU while the bus is quiet and saves the
+      scheduler's wakeup latency when it isn't.
+
+  With `threaded:` the priority, CPU and busy polling apply to the reader
+  thread only, and the thread talking to Elixir runs normally. Options
+  left out keep their current setting, which to begin with is whatever
+  the BEAM started the port with, and carry over when the interface is
+  reopened.
+
+  The priority and memory locking need `CAP_SYS_NICE` and
+  `CAP_IPC_LOCK` (or root). Whatever can be applied is, and the rest is
+  reported as `{:error, {:realtime_failed, [:priority | :cpu | :lock_memory]}}`.
+  Options out of range return `{:error, :einval}` without changing anything.
+  """
+  def set_realtime(pid, opts) do
+    with {:ok, args} <- realtime_args(opts),
+      do: GenServer.call(pid, {:realtime, args})
+  end
+
+  @doc """
+  Dumps the flight recorder now, as if one of its triggers had matched.
+
+  With `recorder: opts` passed to `open/3`, the port keeps the last
+  `:capacity` frames received (100_000 by default), with their receive
+  timestamps, whether or not they're delivered. When a trigger fires,
+  it carries on recording for `:post_ms` (default 1000, at most a day), then sends every
+  frame from `:pre_ms` (default 5000) before the trigger onwards to the
+  process that opened the interface in one go:
+
+      {:can_recording, interface, %{trigger: trigger, triggered_at: ns,
+                                    frames: [{timestamp_ns, id, data}]}}
+
+  With `file: path` the frames are appended to `path` in `candump -L`
+  format instead, and `{:can_recording_saved, interface, %{trigger:
+  trigger, triggered_at: ns, path: path, frames: count}}` is sent.
+  Triggers seen before the dump is done are ignored.
+
+  `:triggers` is a list of:
+
+    * `{:id, id}` or `{:id, id, mask}` - a frame with a matching id
+    * `{:payload, id, data}` or `{:payload, id, data, mask}` - a frame with
+      a matching id whose payload matches `data` in the bits set in `mask`
+      (by default, every bit of the bytes in `data`)
+    * `:error_frame` - any error frame
+
+  As with `set_decimation/2`, ids above `0x7FF` match extended frames.
+  `open/3` returns `{:error, :einval}` for a trigger of any other shape
+  or with more than 8 bytes of `data` or `mask`.
+
+  `trigger` in the message is `{:id, id}`, `{:payload, id}`,
+  `:error_frame` or `:manual`.
+
+      Ng.Can.open(can_port, "can0", recorder: [pre_ms: 10_000, triggers: [:error_frame, {:id, 0x7DF}]])
+  """
+  def trigger_recording(pid) do
+    GenServer.call(pid, :trigger_recording)
+  end
+
+  @doc """
+  Opens the CAN interface `name` as a J1939 channel instead of raw frames,
+  using the kernel's `CAN_J1939` sockets. The kernel reassembles
+  multi-packet (TP/BAM) messages, so `await_read/1` delivers
+  `{:j1939_messages, interface, messages}` with complete messages of up to
+  1785 bytes, each `{pgn, source, destination, priority, data}`.
+  Destination `0xFF` means broadcast.
+
+  Options:
+
+    * `:address` - source address to send from. Without it the channel
+      only receives.
+    * `:name` - 64 bit J1939 NAME. With `:address`, an address claim for
+      it is sent on open, and the kernel keeps track of the claims on the
+      bus from then on. If an ECU with a higher priority NAME claims the
+      same address, writes fail with `:eaddrnotavail`; picking another
+      address is up to the caller.
+    * `:promisc` - receive every message on the bus, not just those sent to
+      `:address` or broadcast
+    * `:filters` - only receive messages matching one of these, each a
+      keyword list of `:pgn`, `:source` and/or `:name`. Masks default to
+      matching the value exactly and can be set with `:pgn_mask`,
+      `:source_mask` and `:name_mask`.
+    * `:rcvbuf` - socket receive buffer size in bytes
+
+  Returns `{:error, :einval}`, without touching an open channel, if an
+  option is out of range (e.g. an address above `0xFF` or a pgn above
+  `0x3FFFF`).
+
+      Ng.Can.open_j1939(can_port, "can0", address: 0x80, name: 0x8000_0000_0000_1234,
+                        filters: [[pgn: 0xFEF1], [pgn: 0xF004]])
+  """
+  def open_j1939(pid, name, args \\ []) do
+    GenServer.call(pid, {:open_j1939, name, args})
+  end
+
+  @doc """
+  Sends J1939 messages on a channel opened with `open_j1939/3`. Each is
+  `{pgn, destination, data}` or `{pgn, destination, data, priority}`, with
+  priority defaulting to 6 and destination `0xFF` for broadcast. Messages
+  longer than 8 bytes go out using the transport protocol.
+
+  Returns `:ok`, or `{:error, {reason, n}}` if the message after the first
+  `n` couldn't be sent, e.g. `:eagain` while a transport session to the
+  same destination is still running. A pgn above `0x3FFFF`, destination
+  above `0xFF`, priority above 7 or non-binary data is `{:error, :einval}`
+  and nothing is sent.
+  """
+  def write_j1939(pid, messages) when is_list(messages) do
+    messages = Enum.map(messages, &j1939_message/1)
+    if Enum.member?(messages, :error),
+      do: {:error, :einval},
+      else: GenServer.call(pid, {:write_j1939, messages})
+  end
+  def write_j1939(pid, message), do: write_j1939(pid, [message])
+
   def await_read(pid) do
     GenServer.cast(pid, :await_read)
   end
 
+  @doc """
+  Replaces the receive decimation rules without reopening the socket.
+  Decimation happens in the port, before frames are sent to Elixir.
+
+  Each rule is `{id, opts}` or `{{id, mask}, opts}`, where a mask applies
+  the rule to every id with `(frame_id &&& mask) == (id &&& mask)`. Ids
+  above `0x7FF` can only be extended, so they get the extended frame flag
+  (`0x80000000`) added; a standard id is matched as a standard frame. Each
+  id matching a rule is decimated on its own; the first matching rule
+  wins. `opts` is one of:
+
+    * `every: n` - deliver every nth frame
+    * `window: ms` - deliver at most one frame per window. A frame that
+      arrives inside the window is held and delivered when the window
+      ends, and a newer frame replaces it.
+
+  Ids that match no rule are delivered at full rate. Pass `[]` to turn
+  decimation off. Returns `{:error, :einval}` if a rule isn't one of the
+  shapes above or `n`/`ms` isn't a positive integer.
+
+      Ng.Can.set_decimation(can_port, [{0x0CF00400, every: 100},
+                                       {{0x700, 0x7F0}, window: 100}])
+  """
+  def set_decimation(pid, rules) do
+    with {:ok, rules} <- decimate_rules(rules),
+      do: GenServer.call(pid, {:decimate, rules})
+  end
+
+  @doc """
+  Returns `{:ok, stats}` where stats is a map of counters for the open
+  interface: frames/bytes received and sent, kernel receive queue drops,
+  write retries, transmit queue depth, frames dropped from this process's
+  receive buffer, poll wakeups and a histogram of frames per notification.
+
+  Every call also emits a `[:ng_can, :stats]` telemetry event (when
+  `:telemetry` is available) with the counters as measurements. Passing
+  `stats_interval: ms` to `open/3` emits the event periodically.
+  """
+  def stats(pid) do
+    GenServer.call(pid, :stats)
+  end
+
   def init(args) do
     executable = :code.priv_dir(:ng_can) ++ '/ng_can'
     port = Port.open({:spawn_executable, executable},
@@ -56,9 +334,7 @@ defmodule Ng.Can do
 
   #port communication
   def handle_info({_, {:data, <<?n, message::binary>>}}, state) do
-    {:notif, frames, num_frames} = :erlang.binary_to_term(message)
-    state = enqueue_frames(num_frames, frames, state)
-    {:noreply, forward_frames(state)}
+    {:noreply, handle_notification(:erlang.binary_to_term(message), state)}
   end
 
   #port error
@@ -69,17 +345,74 @@ defmodule Ng.Can do
 
   def handle_info({_, {:data, <<?r, _::binary>>}}, state), do: {:noreply, state}
 
+  def handle_info({:timeout, timer, :emit_stats}, %{stats_timer: timer} = state) do
+    collect_stats(state)
+    {:noreply, %{state | stats_timer: schedule_stats(state.stats_interval)}}
+  end
+
+  def handle_info({:timeout, _timer, :emit_stats}, state), do: {:noreply, state}
+
   def handle_info({_, {:exit_status, status}}, state) do
     Logger.info("can port exited with status: #{inspect status}")
     exit(:port_err)
   end
 
+  defp handle_notification({:notif, frames, num_frames}, state) do
+    state = enqueue_frames(num_frames, frames, state)
+    forward_frames(state)
+  end
+
+  defp handle_notification({:j1939, messages, num_messages}, state) do
+    state = enqueue_frames(num_messages, messages, state)
+    forward_frames(state)
+  end
+
+  defp handle_notification({:recording, _trigger, _triggered_at, frames, true}, state) do
+    %{state | recording: [frames | state.recording]}
+  end
+
+  defp handle_notification({:recording, trigger, triggered_at, frames, false}, state) do
+    frames = [frames | state.recording] |> Enum.reverse() |> Enum.concat()
+    send(state.awaiting_process, {:can_recording, state.interface,
+                                  %{trigger: trigger, triggered_at: triggered_at, frames: frames}})
+    %{state | recording: []}
+  end
+
+  defp handle_notification({:recording_saved, trigger, triggered_at, num_frames}, state) do
+    send(state.awaiting_process, {:can_recording_saved, state.interface,
+                                  %{trigger: trigger, triggered_at: triggered_at,
+                                    path: state.recorder_file, frames: num_frames}})
+    state
+  end
+
+  defp handle_notification({:tx_confirm, confirmations}, state) do
+    confirms = Enum.reduce(confirmations, state.confirms, fn {seq, index, timestamp}, confirms ->
+      case confirms[seq] do
+        {pid, tag, mode, accepted} ->
+          last = index == accepted - 1
+          cond do
+            mode == :frame ->
+              send(pid, {:can_tx_confirmed, state.interface, {tag, index}, timestamp})
+            last ->
+              send(pid, {:can_tx_confirmed, state.interface, tag, timestamp})
+            true ->
+              nil
+          end
+          if last, do: Map.delete(confirms, seq), else: confirms
+        nil ->
+          confirms
+      end
+    end)
+    %{state | confirms: confirms}
+  end
+
   defp enqueue_frames(num_frames, frames, state) do
     new_buffer = state.rcvbuf ++ frames
     num_to_trash = num_frames + state.rcvbuf_len - 1000
     if num_to_trash > 0 do
       {_trashed, new_buffer} = Enum.split(new_buffer, num_to_trash)
-      %{state | rcvbuf: new_buffer, rcvbuf_len: 1000}
+      %{state | rcvbuf: new_buffer, rcvbuf_len: 1000,
+        rcvbuf_drops: state.rcvbuf_drops + num_to_trash}
     else
       %{state | rcvbuf: new_buffer,
         rcvbuf_len: num_frames + state.rcvbuf_len}
@@ -92,27 +425,104 @@ defmodule Ng.Can do
   defp forward_frames(state) do
     num_remaining = max(0, state.rcvbuf_len - 100)
     {to_send, unsent} = Enum.split(state.rcvbuf, 100)
-    send(state.awaiting_process, {:can_frames, state.interface, to_send})
+    tag = if state.mode == :j1939, do: :j1939_messages, else: :can_frames
+    send(state.awaiting_process, {tag, state.interface, to_send})
     %{state | rcvbuf: unsent, rcvbuf_len: num_remaining, awaiting_read: false}
   end
 
   def handle_call({:open, interface, args}, {from_pid, _}, state) do
-    :os.cmd('ip link set #{interface} type can bitrate 250000 triple-sampling on restart-ms 100')
-    :os.cmd 'ip link set #{interface} up type can'
-    :os.cmd 'ifconfig #{interface} txqueuelen 1000'
+    setup_interface(interface, if(args[:tx_queues], do: @tx_queued_txqueuelen, else: 1000))
     response = call_port(state, :open,
                          {interface, args[:rcvbuf] || @default_bufsize,
                            args[:sndbuf] || @default_bufsize
                          })
-    {:reply, response, %{state | awaiting_process: from_pid, interface: interface}}
+    response = if response == :ok, do: configure_rx(state, args), else: response
+    response = if response == :ok, do: configure_tx(state, args), else: response
+    response = if response == :ok, do: call_port(state, :threaded, threaded_args(args[:threaded])), else: response
+    #only when asked, so a reopen doesn't undo set_realtime/2 or what the port inherited
+    response = if response == :ok and args[:realtime] != nil,
+      do: configure_realtime(state, args[:realtime]), else: response
+    state = if response == :ok, do: restart_stats(state, args[:stats_interval]), else: state
+    {:reply, response, %{state | awaiting_process: from_pid, interface: interface,
+                         mode: :raw, rcvbuf_drops: 0,
+                         tx_confirm: response == :ok and args[:tx_confirm] == true,
+                         confirms: %{}, confirm_order: :queue.new(), confirm_order_len: 0,
+                         recording: [],
+                         recorder_file: args[:recorder] && args[:recorder][:file]}}
+  end
+
+  def handle_call({:open_j1939, interface, args}, {from_pid, _}, state) do
+    case j1939_open_args(interface, args) do
+      {:ok, open_args} ->
+        setup_interface(interface, 1000)
+        case call_port(state, :j1939_open, open_args) do
+          :ok ->
+            {:reply, :ok, %{state | awaiting_process: from_pid, interface: interface,
+                            mode: :j1939, rcvbuf: [], rcvbuf_len: 0, rcvbuf_drops: 0,
+                            tx_confirm: false, confirms: %{}, confirm_order: :queue.new(),
+                            confirm_order_len: 0}}
+          #the port may have closed the raw socket already; it refuses writes then
+          error ->
+            {:reply, error, state}
+        end
+      error ->
+        {:reply, error, state}
+    end
+  end
+
+  def handle_call({:write_j1939, _}, _from, %{mode: :raw} = state) do
+    {:reply, {:error, :not_j1939}, state}
+  end
+
+  def handle_call({:write_j1939, messages}, _from, state) do
+    {:reply, call_port(state, :j1939_write, messages), state}
+  end
+
+  def handle_call({:write, _, _, _}, _from, %{mode: :j1939} = state) do
+    {:reply, {:error, :not_raw}, state}
+  end
+
+  def handle_call({:write, _, _, {_, _}}, _from, %{tx_confirm: false} = state) do
+    {:reply, {:error, :tx_confirm_disabled}, state}
   end
 
   #frames is a list of tuples {can_identifier, can_payload}
-  def handle_call({:write, frames}, {from_pid, _}, state) do
-    response = call_port(state, :write, frames)
+  def handle_call({:write, tx_class, frames, nil}, _from, state) do
+    response = call_port(state, :write, {tx_class, 0, frames})
     {:reply, response, state}
   end
 
+  def handle_call({:write, tx_class, frames, {tag, mode}}, {from_pid, _}, state) do
+    #0 means no confirmation to the port, so sequence numbers start at 1
+    seq = rem(state.confirm_seq, 0xFFFFFFFF) + 1
+    response = call_port(state, :write, {tx_class, seq, frames})
+    accepted = case response do
+      :ok -> length(frames)
+      {:error, {:tx_queue_full, rejected}} -> length(frames) - rejected
+      _ -> 0
+    end
+    state = if accepted > 0,
+      do: track_confirm(state, seq, {from_pid, tag, mode, accepted}),
+      else: state
+    {:reply, response, %{state | confirm_seq: seq}}
+  end
+
+  def handle_call({:realtime, args}, _from, state) do
+    {:reply, call_port(state, :realtime, args), state}
+  end
+
+  def handle_call(:trigger_recording, _from, state) do
+    {:reply, call_port(state, :record_trigger, nil), state}
+  end
+
+  def handle_call({:decimate, rules}, _from, state) do
+    {:reply, call_port(state, :decimate, rules), state}
+  end
+
+  def handle_call(:stats, _from, state) do
+    {:reply, collect_stats(state), state}
+  end
+
   def handle_call(:read, {from_pid, _}, state) do
     response = call_port(state, :read, nil)
     {:reply, response, state}
@@ -126,6 +536,239 @@ defmodule Ng.Can do
     Logger.info "Ng.Can terminating with reason: #{inspect reason}"
   end
 
+  defp setup_interface(interface, txqueuelen) do
+    :os.cmd('ip link set #{interface} type can bitrate 250000 triple-sampling on restart-ms 100')
+    :os.cmd 'ip link set #{interface} up type can'
+    :os.cmd 'ifconfig #{interface} txqueuelen #{txqueuelen}'
+  end
+
+  #receive filtering is always (re)configured so a reopen starts clean
+  defp configure_rx(state, args) do
+    with {:ok, rules} <- decimate_rules(args[:decimate] || []),
+         {:ok, recorder} <- recorder_args(args[:recorder]),
+         {:ok, change_filter} <- change_filter_args(args[:on_change]),
+         :ok <- call_port(state, :change_filter, change_filter),
+         :ok <- call_port(state, :decimate, rules),
+         :ok <- call_port(state, :coalesce, coalesce_args(args[:coalesce])),
+      do: call_port(state, :recorder, recorder)
+  end
+
+  defp configure_tx(state, args) do
+    with {:ok, queues} <- tx_queue_args(args[:tx_queues] || []),
+         :ok <- call_port(state, :tx_queues, queues),
+      do: call_port(state, :tx_confirm, args[:tx_confirm] == true)
+  end
+
+  #the port exits on a depth or policy it can't use, so they're checked here
+  defp tx_queue_args(tx_queues) when is_list(tx_queues) do
+    queues = for tx_class <- @tx_classes do
+      tx_queue(Keyword.merge(@default_tx_queue, tx_queues[tx_class] || []))
+    end
+    if Enum.member?(queues, :error), do: {:error, :einval}, else: {:ok, queues}
+  end
+  defp tx_queue_args(_tx_queues), do: {:error, :einval}
+
+  defp tx_queue(opts) do
+    depth = opts[:depth]
+    if is_integer(depth) and depth > 0 and opts[:policy] in [:reject, :drop_oldest],
+      do: {depth, opts[:policy]},
+      else: :error
+  end
+
+  #missing privileges shouldn't keep the interface from opening
+  defp configure_realtime(state, opts) do
+    with {:ok, args} <- realtime_args(opts) do
+      case call_port(state, :realtime, args) do
+        {:error, {:realtime_failed, parts}} ->
+          Logger.warn("Ng.Can couldn't apply realtime options #{inspect parts}, running without them")
+          :ok
+        response ->
+          response
+      end
+    end
+  end
+
+  #-1 leaves a setting as it is
+  defp realtime_args(opts) do
+    cpu = case opts[:cpu] do
+      nil -> -1
+      :any -> -2
+      cpu -> if in_range?(cpu, @max_cpu), do: cpu, else: :error
+    end
+    lock_memory = case opts[:lock_memory] do
+      nil -> -1
+      true -> 1
+      false -> 0
+      _ -> :error
+    end
+    priority = opts[:priority] || -1
+    busy_poll_us = opts[:busy_poll_us] || -1
+    if cpu == :error or lock_memory == :error or
+       not (priority == -1 or in_range?(priority, 99)) or
+       not (busy_poll_us == -1 or in_range?(busy_poll_us, 0x7FFFFFFF)),
+      do: {:error, :einval},
+      else: {:ok, {priority, cpu, lock_memory, busy_poll_us}}
+  end
+
+  defp threaded_args(nil), do: false
+  defp threaded_args(false), do: false
+  defp threaded_args(true), do: @default_ring_size
+  defp threaded_args(opts), do: opts[:ring_size] || @default_ring_size
+
+  defp coalesce_args(nil), do: {1, 0}
+  defp coalesce_args(opts) do
+    frames = opts[:frames] || 1
+    {frames, if(frames > 1, do: opts[:timeout_us] || @default_coalesce_us, else: 0)}
+  end
+
+  #the port exits on values it can't decode, so they're range checked here
+  defp j1939_open_args(interface, args) do
+    filters = args[:filters] || []
+    filters = if is_list(filters), do: Enum.map(filters, &j1939_filter/1), else: [:error]
+    name = args[:name] || @j1939_no_name
+    address = args[:address] || @j1939_no_addr
+    if Enum.member?(filters, :error) or not in_range?(name, 0xFFFFFFFFFFFFFFFF) or
+       not in_range?(address, @j1939_no_addr),
+      do: {:error, :einval},
+      else: {:ok, {interface, args[:rcvbuf] || @default_bufsize, name, address,
+                   args[:promisc] == true, filters}}
+  end
+
+  defp j1939_message({pgn, dest, data}), do: j1939_message({pgn, dest, data, @j1939_default_priority})
+  defp j1939_message({pgn, dest, data, priority}) when is_binary(data) do
+    if in_range?(pgn, @j1939_pgn_max) and in_range?(dest, @j1939_no_addr) and in_range?(priority, 7),
+      do: {pgn, dest, priority, data},
+      else: :error
+  end
+  defp j1939_message(_message), do: :error
+
+  #a field left out matches anything
+  defp j1939_filter(opts) when is_list(opts) do
+    fields = [{opts[:name] || 0, 0xFFFFFFFFFFFFFFFF},
+              {opts[:name_mask] || (if opts[:name], do: 0xFFFFFFFFFFFFFFFF, else: 0), 0xFFFFFFFFFFFFFFFF},
+              {opts[:pgn] || 0, @j1939_pgn_max},
+              {opts[:pgn_mask] || (if opts[:pgn], do: @j1939_pgn_max, else: 0), @j1939_pgn_max},
+              {opts[:source] || 0, 0xFF},
+              {opts[:source_mask] || (if opts[:source], do: 0xFF, else: 0), 0xFF}]
+    if Enum.all?(fields, fn {value, max} -> in_range?(value, max) end),
+      do: fields |> Enum.map(&elem(&1, 0)) |> List.to_tuple(),
+      else: :error
+  end
+  defp j1939_filter(_opts), do: :error
+
+  defp in_range?(value, max), do: is_integer(value) and value >= 0 and value <= max
+
+  defp recorder_args(nil), do: {:ok, :off}
+  defp recorder_args(opts) do
+    opts = Keyword.merge(@default_recorder, opts)
+    file = if opts[:file], do: to_string(opts[:file])
+    triggers = Enum.map(opts[:triggers], &recorder_trigger/1)
+    if Enum.member?(triggers, :error),
+      do: {:error, :einval},
+      else: {:ok, {opts[:capacity], opts[:pre_ms], opts[:post_ms], triggers, file}}
+  end
+
+  defp recorder_trigger(:error_frame), do: :error_frame
+  defp recorder_trigger({:id, id}) when is_integer(id), do: {:id, with_eff_flag(id), 0xFFFFFFFF}
+  defp recorder_trigger({:id, id, mask}) when is_integer(id) and is_integer(mask),
+    do: {:id, with_eff_flag(id), mask}
+  defp recorder_trigger({:payload, id, data}) when is_binary(data),
+    do: recorder_trigger({:payload, id, data, :binary.copy(<<0xFF>>, byte_size(data))})
+  defp recorder_trigger({:payload, id, data, mask}) when is_integer(id) and
+                                                         is_binary(data) and byte_size(data) <= 8 and
+                                                         is_binary(mask) and byte_size(mask) <= 8,
+    do: {:payload, with_eff_flag(id), 0xFFFFFFFF, pad_with_zeros(data), pad_with_zeros(mask)}
+  defp recorder_trigger(_trigger), do: :error
+
+  defp pad_with_zeros(bytes), do: bytes <> :binary.copy(<<0>>, 8 - byte_size(bytes))
+
+  #seqs wrap, so the oldest is found by insertion order rather than value
+  defp track_confirm(state, seq, pending) do
+    state = %{state | confirms: Map.put(state.confirms, seq, pending),
+                      confirm_order: :queue.in(seq, state.confirm_order),
+                      confirm_order_len: state.confirm_order_len + 1}
+    prune_confirms(state)
+  end
+
+  defp prune_confirms(%{confirm_order_len: len} = state) when len <= @max_pending_confirms, do: state
+  defp prune_confirms(state) do
+    {{:value, oldest}, order} = :queue.out(state.confirm_order)
+    %{state | confirms: Map.delete(state.confirms, oldest), confirm_order: order,
+              confirm_order_len: state.confirm_order_len - 1}
+  end
+
+  #the port exits on a rule it can't decode, so bad ones are caught here
+  defp decimate_rules(rules) when is_list(rules) do
+    rules = Enum.map(rules, &decimate_rule/1)
+    if Enum.member?(rules, :error), do: {:error, :einval}, else: {:ok, rules}
+  end
+  defp decimate_rules(_rules), do: {:error, :einval}
+
+  defp decimate_rule({{id, mask}, [every: n]}) when is_integer(id) and is_integer(mask) and
+                                                    is_integer(n) and n > 0,
+    do: {with_eff_flag(id), mask, :every, n}
+  defp decimate_rule({{id, mask}, [window: ms]}) when is_integer(id) and is_integer(mask) and
+                                                      is_integer(ms) and ms > 0,
+    do: {with_eff_flag(id), mask, :window, ms}
+  defp decimate_rule({id, opts}) when is_integer(id), do: decimate_rule({{id, 0xFFFFFFFF}, opts})
+  defp decimate_rule(_rule), do: :error
+
+  #ids that don't fit in 11 bits can only arrive as extended frames
+  defp with_eff_flag(id) when id > 0x7FF, do: id ||| @can_eff_flag
+  defp with_eff_flag(id), do: id
+
+  defp change_filter_args(nil), do: {:ok, :off}
+  defp change_filter_args(false), do: {:ok, :off}
+  defp change_filter_args(true), do: change_filter_args([])
+  defp change_filter_args(opts) when is_list(opts) do
+    refresh = opts[:refresh] || 0
+    masks = Enum.map(opts[:masks] || [], &change_mask/1)
+    if Enum.member?(masks, :error) or not (is_integer(refresh) and refresh >= 0),
+      do: {:error, :einval},
+      else: {:ok, {refresh, masks}}
+  end
+  defp change_filter_args(_opts), do: {:error, :einval}
+
+  defp change_mask({id, mask}) when is_integer(id) and id >= 0 and
+                                    is_binary(mask) and byte_size(mask) <= 8,
+    do: {with_eff_flag(id), pad_mask(mask)}
+  defp change_mask(_mask), do: :error
+
+  defp pad_mask(mask) do
+    mask <> :binary.copy(<<0xFF>>, 8 - byte_size(mask))
+  end
+
+  defp collect_stats(state) do
+    case call_port(state, :stats, nil) do
+      port_stats when is_list(port_stats) ->
+        stats = port_stats
+          |> Map.new()
+          |> Map.merge(%{rcvbuf_len: state.rcvbuf_len, rcvbuf_drops: state.rcvbuf_drops})
+        emit_telemetry(stats, state.interface)
+        {:ok, stats}
+      error ->
+        {:error, error}
+    end
+  end
+
+  #:telemetry is optional, so only report when the host application has it
+  defp emit_telemetry(stats, interface) do
+    if Code.ensure_loaded?(:telemetry) do
+      {hist, measurements} = Map.pop(stats, :notify_batch_hist)
+      apply(:telemetry, :execute, [[:ng_can, :stats], measurements,
+                                   %{interface: interface, notify_batch_hist: hist}])
+    end
+  end
+
+  defp schedule_stats(nil), do: nil
+  defp schedule_stats(interval), do: :erlang.start_timer(interval, self(), :emit_stats)
+
+  #a reopen replaces the previous timer rather than starting a second one
+  defp restart_stats(state, interval) do
+    if state.stats_timer, do: Process.cancel_timer(state.stats_timer)
+    %{state | stats_interval: interval, stats_timer: schedule_stats(interval)}
+  end
+
   defp pad_to_8_bytes(frames) do
     Enum.map frames, fn {id, data} ->
       bits_padding = (8 - byte_size(data)) * 8
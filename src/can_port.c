@@ -16,7 +16,14 @@
 #include <poll.h>
 
 #include <sys/socket.h>
-#include <net/if.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <pthread.h>
+
+const int batch_bucket_bounds[NUM_BATCH_BUCKETS] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, MAX_NOTIFY_FRAMES};
 
 int can_init(struct can_port **pport)
 {
@@ -26,11 +33,44 @@ int can_init(struct can_port **pport)
     port->fd = -1;
 
     //write buffer stuff
-    port->write_buffer_size = 0;
-    port->write_buffer = NULL;
+    for (int i = 0; i < TX_NUM_CLASSES; i++)
+      tx_queue_init(&port->tx_queues[i]);
+
+    port->tx_confirm = false;
+    port->tx_pending = malloc(TX_PENDING_DEPTH * sizeof(struct tx_pending));
+    port->tx_pending_head = 0;
+    port->tx_pending_count = 0;
+    port->confirmations = malloc(MAX_NOTIFY_FRAMES * sizeof(struct tx_confirmation));
+    port->num_confirmations = 0;
 
     //read buffer stuff
-    port->read_buffer = NULL;
+    port->read_buffer = malloc(NOTIFY_BUFFER_SIZE);
+    port->batch_index = 0;
+    port->batch_frames = 0;
+    port->recording_buffer = malloc(RECORDER_CHUNK_BUFFER_SIZE);
+
+    port->coalesce_frames = 1;
+    port->coalesce_us = 0;
+    port->coalesce_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    port->coalesce_timer_armed = false;
+    if (port->read_buffer == NULL || port->recording_buffer == NULL || port->coalesce_timer_fd < 0)
+      return -1;
+
+    port->threaded = false;
+    port->reader_notify_fd = -1;
+    port->reader_stop_fd = -1;
+    port->reader_error = 0;
+
+    rx_filter_init(&port->rx_filter);
+    recorder_init(&port->recorder);
+    //the process keeps whatever it was started with until told otherwise
+    port->realtime.priority = REALTIME_UNCHANGED;
+    port->realtime.cpu = REALTIME_UNCHANGED;
+    port->realtime.lock_memory = REALTIME_UNCHANGED;
+    port->realtime.busy_poll_us = 0;
+    port->interface_name[0] = '\0';
+
+    memset(&port->stats, 0, sizeof(port->stats));
 
     return 0;
 }
@@ -42,6 +82,7 @@ int can_is_open(struct can_port *port)
 
 int can_close(struct can_port *port)
 {
+  can_stop_reader(port);
   close(port->fd);
   port->fd = -1;
   return 0;
@@ -61,15 +102,35 @@ int can_open(struct can_port *can_port, char *interface_name, long *rcvbuf_size,
   fcntl(s, F_SETFL, flags | O_NONBLOCK);
 
   can_port->fd = s;
+  memset(&can_port->stats, 0, sizeof(can_port->stats));
+  //frames queued for the previous interface are not sent to this one
+  for (int i = 0; i < TX_NUM_CLASSES; i++)
+    tx_queue_clear(&can_port->tx_queues[i]);
+  can_port->tx_confirm = false;
+  can_port->tx_pending_count = 0;
+  //payloads seen on another interface say nothing about this one
+  rx_filter_clear(&can_port->rx_filter);
 
   //get interface index
   strcpy(ifr.ifr_name, interface_name);
+  strcpy(can_port->interface_name, interface_name);
   ioctl(s, SIOCGIFINDEX, &ifr);
 
   //add busoff error filter
   can_err_mask_t err_mask = CAN_ERR_MASK;
   setsockopt(s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
 
+  //report kernel receive queue drops with every frame
+  int enable = 1;
+  setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+
+  //only helps drivers with NAPI, but costs nothing on the others.
+  //Raising it needs CAP_NET_ADMIN; busy_poll() spins in userspace regardless
+  if (can_port->realtime.busy_poll_us > 0) {
+    int busy_poll_us = can_port->realtime.busy_poll_us;
+    setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+  }
+
   //set buffersizes
   if(setsockopt(s, SOL_SOCKET, SO_RCVBUF, rcvbuf_size, sizeof(*rcvbuf_size)) < 0)
     errx(EXIT_FAILURE, "badrcvbuf");
@@ -88,6 +149,258 @@ int can_write(struct can_port *can_port, struct can_frame *can_frame)
   return write(can_port->fd, can_frame, sizeof(struct can_frame));
 }
 
+struct can_frame parse_can_frame(const char *req, int *req_index)
+{
+    struct can_frame can_frame;
+    int num_tuple_elements;
+    if(ei_decode_tuple_header(req, req_index, &num_tuple_elements) < 0 || num_tuple_elements != 2)
+      errx(EXIT_FAILURE, "Bad Tuple");
+    unsigned long id;
+    if (ei_decode_ulong(req, req_index, &id) < 0)
+      errx(EXIT_FAILURE, "Bad Can ID");
+    long data_len;
+    char data[8] = "";
+    if(ei_decode_binary(req, req_index, data, &data_len) < 0 || data_len != 8)
+      errx(EXIT_FAILURE, "Bad Data");
+
+    can_frame.can_id = id;
+    can_frame.can_dlc = data_len;
+    memcpy(can_frame.data, data, 8);
+    return can_frame;
+}
+
+static bool tx_retryable(int error)
+{
+  //ENETDOWN is okay since we're restarting using `ip link` in ng_can.ex?
+  return error == EAGAIN || error == ENOBUFS || error == ENETDOWN;
+}
+
+/**
+ * @brief Ask the kernel to timestamp received frames if tx confirmations or
+ * the flight recorder need it
+ */
+static int set_timestamping(struct can_port *can_port)
+{
+  //software only: a controller's raw hardware clock isn't related to the
+  //epoch, and confirmations and recordings promise CLOCK_REALTIME
+  int timestamping = 0;
+  if (can_port->tx_confirm || can_port->recorder.enabled)
+    timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  return setsockopt(can_port->fd, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping));
+}
+
+/**
+ * @brief Turn tx confirmations on or off. When on, the socket receives
+ * its own frames back (flagged MSG_CONFIRM) with a timestamp, and every
+ * written frame is remembered until its echo arrives.
+ *
+ * @return 0 on success, -1 if the socket options couldn't be set
+ */
+int can_set_tx_confirm(struct can_port *can_port, bool enabled)
+{
+  int recv_own = enabled;
+  if (setsockopt(can_port->fd, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &recv_own, sizeof(recv_own)) < 0)
+    return -1;
+
+  can_port->tx_confirm = enabled;
+  can_port->tx_pending_count = 0;
+  return set_timestamping(can_port);
+}
+
+/**
+ * @brief Apply config to the process and the socket. The priority and CPU
+ * go to the reader thread if there is one, and to the main thread if not.
+ * Fields that are REALTIME_UNCHANGED keep their current setting. Parts
+ * that fail (usually EPERM) are skipped and the rest still applies.
+ *
+ * @return 0, or the realtime_failure bits for what couldn't be applied
+ */
+int can_set_realtime(struct can_port *can_port, struct realtime_config *config)
+{
+  if (config->priority != REALTIME_UNCHANGED)
+    can_port->realtime.priority = config->priority;
+  if (config->cpu != REALTIME_UNCHANGED)
+    can_port->realtime.cpu = config->cpu;
+  if (config->lock_memory != REALTIME_UNCHANGED)
+    can_port->realtime.lock_memory = config->lock_memory;
+  if (config->busy_poll_us != REALTIME_UNCHANGED) {
+    //the reader thread reads this on its own
+    __atomic_store_n(&can_port->realtime.busy_poll_us, config->busy_poll_us, __ATOMIC_RELAXED);
+    if (can_is_open(can_port)) {
+      int busy_poll_us = config->busy_poll_us;
+      setsockopt(can_port->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+    }
+  }
+
+  if (!can_port->threaded)
+    return realtime_apply_process(config);
+
+  //the reader thread does the latency-sensitive work, so only it is raised
+  //and pinned rather than both threads competing for one CPU
+  struct realtime_config process = *config;
+  process.priority = REALTIME_UNCHANGED;
+  process.cpu = REALTIME_UNCHANGED;
+  return realtime_apply_thread(can_port->reader, config) | realtime_apply_process(&process);
+}
+
+/**
+ * @brief Hand the priority and CPU set by can_set_realtime over from the
+ * main thread to a reader thread that has just inherited them
+ */
+static void demote_main_thread(struct can_port *can_port)
+{
+  struct realtime_config normal = {
+    can_port->realtime.priority > 0 ? 0 : REALTIME_UNCHANGED,
+    can_port->realtime.cpu != REALTIME_UNCHANGED ? REALTIME_ANY_CPU : REALTIME_UNCHANGED,
+    REALTIME_UNCHANGED,
+    REALTIME_UNCHANGED
+  };
+  realtime_apply_thread(pthread_self(), &normal);
+}
+
+/**
+ * @brief Start recording every received frame for dumps, replacing any
+ * earlier recording. capacity 0 turns the recorder off.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int can_set_recorder(struct can_port *can_port, uint32_t capacity, uint64_t pre_ms, uint64_t post_ms,
+                     const struct recorder_trigger *triggers, int num_triggers, const char *path)
+{
+  if (capacity == 0)
+    recorder_disable(&can_port->recorder);
+  else if (recorder_configure(&can_port->recorder, capacity, pre_ms, post_ms,
+                              triggers, num_triggers, path) < 0)
+    return -1;
+  return can_is_open(can_port) ? set_timestamping(can_port) : 0;
+}
+
+static void count_tx(struct can_port *can_port, struct tx_frame *tx_frame)
+{
+  can_port->stats.tx_frames++;
+  can_port->stats.tx_bytes += tx_frame->can_frame.can_dlc;
+
+  if (!can_port->tx_confirm)
+    return;
+  //the oldest frame's echo is overdue if the ring is full
+  if (can_port->tx_pending_count == TX_PENDING_DEPTH) {
+    can_port->tx_pending_head = (can_port->tx_pending_head + 1) % TX_PENDING_DEPTH;
+    can_port->tx_pending_count--;
+    can_port->stats.tx_confirm_lost++;
+  }
+  int tail = (can_port->tx_pending_head + can_port->tx_pending_count) % TX_PENDING_DEPTH;
+  can_port->tx_pending[tail].can_id = tx_frame->can_frame.can_id;
+  can_port->tx_pending[tail].tag = tx_frame->tag;
+  can_port->tx_pending[tail].index = tx_frame->index;
+  can_port->tx_pending_count++;
+}
+
+/**
+ * @brief Match an echoed frame to the oldest frame written with the same
+ * id. Frames written before it are assumed lost.
+ */
+static void confirm_tx(struct can_port *can_port, struct can_frame *can_frame, uint64_t timestamp)
+{
+  while (can_port->tx_pending_count > 0) {
+    struct tx_pending *pending = &can_port->tx_pending[can_port->tx_pending_head];
+    can_port->tx_pending_head = (can_port->tx_pending_head + 1) % TX_PENDING_DEPTH;
+    can_port->tx_pending_count--;
+
+    if (pending->can_id != can_frame->can_id) {
+      can_port->stats.tx_confirm_lost++;
+      continue;
+    }
+    can_port->stats.tx_confirmed++;
+    if (pending->tag != 0 && can_port->num_confirmations < MAX_NOTIFY_FRAMES) {
+      struct tx_confirmation *confirmation = &can_port->confirmations[can_port->num_confirmations++];
+      confirmation->tag = pending->tag;
+      confirmation->index = pending->index;
+      confirmation->timestamp = timestamp;
+    }
+    return;
+  }
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+  return ((uint64_t) ts->tv_sec) * 1000000000ULL + ts->tv_nsec;
+}
+
+/**
+ * @brief Write a frame now if nothing of the same or a higher priority
+ * class is waiting, otherwise queue it behind them. Lower priority frames
+ * that are already queued never hold it back.
+ *
+ * @param tx_class 0 is the highest priority
+ * @return 0 if written or queued, 1 if the queue rejected it, -1 on a write error
+ */
+int can_send_frame(struct can_port *can_port, int tx_class, struct tx_frame *tx_frame)
+{
+  bool blocked = false;
+  for (int i = 0; i <= tx_class; i++)
+    blocked = blocked || !tx_queue_empty(&can_port->tx_queues[i]);
+
+  if (!blocked) {
+    if (can_write(can_port, &tx_frame->can_frame) >= 0) {
+      count_tx(can_port, tx_frame);
+      return 0;
+    }
+    if (!tx_retryable(errno))
+      return -1;
+    can_port->stats.tx_retries++;
+  }
+
+  switch (tx_queue_push(&can_port->tx_queues[tx_class], tx_frame)) {
+  case TX_REJECTED:
+    can_port->stats.tx_rejected++;
+    return 1;
+  case TX_QUEUED_DROPPED_OLDEST:
+    can_port->stats.tx_dropped++;
+    break;
+  case TX_QUEUED:
+    break;
+  }
+  return 0;
+}
+
+/**
+ * @brief Write queued frames, highest priority class first, until the
+ * socket is full again
+ *
+ * @return 0 on success, -1 on a write error
+ */
+int can_drain_tx_queues(struct can_port *can_port)
+{
+  for (int i = 0; i < TX_NUM_CLASSES; i++) {
+    struct tx_queue *queue = &can_port->tx_queues[i];
+    struct tx_frame *tx_frame;
+    while ((tx_frame = tx_queue_peek(queue)) != NULL) {
+      if (can_write(can_port, &tx_frame->can_frame) < 0) {
+        if (!tx_retryable(errno))
+          return -1;
+        can_port->stats.tx_retries++;
+        return 0;
+      }
+      count_tx(can_port, tx_frame);
+      tx_queue_pop(queue);
+    }
+  }
+  return 0;
+}
+
+bool can_tx_pending(struct can_port *can_port)
+{
+  return can_tx_queue_depth(can_port) > 0;
+}
+
+int can_tx_queue_depth(struct can_port *can_port)
+{
+  int depth = 0;
+  for (int i = 0; i < TX_NUM_CLASSES; i++)
+    depth += can_port->tx_queues[i].count;
+  return depth;
+}
+
 //TODO: dynamically encoded response with ei_x?
 void encode_can_frame(char *resp, int *resp_index, struct can_frame *can_frame)
 {
@@ -103,23 +416,335 @@ int can_read(struct can_port *can_port, struct can_frame *can_frame)
   return read(can_port->fd, can_frame, sizeof(struct can_frame));
 }
 
-int can_read_into_buffer(struct can_port *can_port, int *resp_index)
+/**
+ * @brief Read one frame and its ancillary data from the socket. Safe to
+ * call from the reader thread.
+ *
+ * @return 1 if a frame was read, 0 if none are waiting, -1 on a read error
+ */
+static int can_recv_frame(struct can_port *can_port, struct rx_frame *rx_frame)
+{
+  struct iovec iov = { &rx_frame->can_frame, sizeof(struct can_frame) };
+  char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  int res = recvmsg(can_port->fd, &msg, 0);
+  if(res <= 0){
+    //I think ENETDOWN is ok because catching netdown at a higher level?
+    if(errno == EAGAIN || errno == ENETDOWN)
+      return 0;
+    else
+      return -1;
+  }
+
+  rx_frame->rx_time = 0;
+  rx_frame->flags = msg.msg_flags;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET)
+      continue;
+    //the drop counter is cumulative for the socket, so keep the latest
+    if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      __atomic_store_n(&can_port->stats.rx_kernel_drops, drops, __ATOMIC_RELAXED);
+    } else if (cmsg->cmsg_type == SO_TIMESTAMPING) {
+      struct scm_timestamping ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      rx_frame->rx_time = timespec_ns(&ts.ts[0]);
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Confirm, filter and encode one received frame
+ *
+ * @return 1 if the frame was encoded into can_port->read_buffer
+ */
+static int can_process_frame(struct can_port *can_port, struct rx_frame *rx_frame,
+                             bool filtering, uint64_t now, int *resp_index)
+{
+  struct can_frame *can_frame = &rx_frame->can_frame;
+
+  if (can_port->recorder.enabled)
+    recorder_record(&can_port->recorder, can_frame,
+                    rx_frame->rx_time ? rx_frame->rx_time : realtime_ns());
+
+  //our own frame coming back: it's on the bus now
+  if (rx_frame->flags & MSG_CONFIRM) {
+    confirm_tx(can_port, can_frame, rx_frame->rx_time);
+    return 0;
+  }
+  can_port->stats.rx_frames++;
+  can_port->stats.rx_bytes += can_frame->can_dlc;
+  if (filtering) {
+    enum rx_filter_result result = rx_filter_accept(&can_port->rx_filter, can_frame, now);
+    if (result == RX_FILTER_UNCHANGED)
+      can_port->stats.rx_suppressed++;
+    else if (result == RX_FILTER_DECIMATED)
+      can_port->stats.rx_decimated++;
+    if (result != RX_FILTER_FORWARD)
+      return 0;
+  }
+  encode_can_frame(can_port->read_buffer, resp_index, can_frame);
+  return 1;
+}
+
+/**
+ * @brief Drain frames from the socket and encode the ones that pass the
+ * receive filter into can_port->read_buffer
+ *
+ * @param max_frames most frames to read, at most MAX_NOTIFY_FRAMES
+ * @return the number of frames encoded, or -1 on a read error
+ */
+int can_read_into_buffer(struct can_port *can_port, int *resp_index, int max_frames)
+{
+  int num_encoded = 0;
+  struct rx_frame rx_frame;
+  bool filtering = rx_filter_active(&can_port->rx_filter);
+  uint64_t now = filtering ? current_time() : 0;
+
+  for(int num_read = 0; num_read < max_frames; num_read++){
+    int res = can_recv_frame(can_port, &rx_frame);
+    if (res <= 0)
+      return res < 0 ? -1 : num_encoded;
+    num_encoded += can_process_frame(can_port, &rx_frame, filtering, now, resp_index);
+  }
+  //only a hit if the limit actually left frames behind
+  struct can_frame peeked;
+  if (recv(can_port->fd, &peeked, sizeof(peeked), MSG_PEEK | MSG_DONTWAIT) > 0)
+    can_port->stats.rx_read_limit_hits++;
+  return num_encoded;
+}
+
+/**
+ * @brief Threaded mode's version of can_read_into_buffer: encode up to
+ * max_frames frames that the reader thread has queued
+ *
+ * @return the number of frames encoded, or -1 with errno set if the
+ * reader thread hit a read error
+ */
+int can_read_ring_into_buffer(struct can_port *can_port, int *resp_index, int max_frames)
+{
+  int reader_error = can_reader_error(can_port);
+  if (reader_error != 0) {
+    errno = reader_error;
+    return -1;
+  }
+
+  int num_encoded = 0;
+  struct rx_frame rx_frame;
+  bool filtering = rx_filter_active(&can_port->rx_filter);
+  uint64_t now = filtering ? current_time() : 0;
+
+  for (int num_read = 0; num_read < max_frames; num_read++) {
+    if (!rx_ring_pop(&can_port->rx_ring, &rx_frame))
+      break;
+    num_encoded += can_process_frame(can_port, &rx_frame, filtering, now, resp_index);
+  }
+  return num_encoded;
+}
+
+/**
+ * @return the errno that stopped the reader thread, or 0
+ */
+int can_reader_error(struct can_port *can_port)
+{
+  return __atomic_load_n(&can_port->reader_error, __ATOMIC_ACQUIRE);
+}
+
+static void wake_main(struct can_port *can_port)
 {
-  int num_read;
-  struct can_frame can_frame;
+  uint64_t one = 1;
+  if (write(can_port->reader_notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    warn("reader_notify_fd");
+}
+
+/**
+ * Threaded mode: drain the socket into rx_ring as fast as frames arrive,
+ * so a main thread stuck writing to a slow BEAM doesn't leave them to
+ * overflow the kernel's receive queue.
+ */
+static void *reader_thread(void *arg)
+{
+  struct can_port *can_port = arg;
+  struct pollfd fdset[2];
+  fdset[0].fd = can_port->fd;
+  fdset[0].events = POLLIN;
+  fdset[1].fd = can_port->reader_stop_fd;
+  fdset[1].events = POLLIN;
+
+  for (;;) {
+    fdset[0].revents = 0;
+    fdset[1].revents = 0;
+    bool spun;
+    int busy_poll_us = __atomic_load_n(&can_port->realtime.busy_poll_us, __ATOMIC_RELAXED);
+    int rc = busy_poll(fdset, 2, -1, busy_poll_us, &spun);
+    if (spun)
+      __atomic_add_fetch(&can_port->stats.busy_poll_hits, 1, __ATOMIC_RELAXED);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      __atomic_store_n(&can_port->reader_error, errno, __ATOMIC_RELEASE);
+      wake_main(can_port);
+      return NULL;
+    }
+    if (fdset[1].revents & POLLIN)
+      return NULL;
+    if (!(fdset[0].revents & POLLIN))
+      continue;
 
-  for(num_read = 0; num_read < 1000; num_read++){
-    int res = read(can_port->fd, &can_frame, sizeof(struct can_frame));
-    if(res <= 0){
-      //I think ENETDOWN is ok because catching netdown at a higher level?
-      if(errno == EAGAIN || errno == ENETDOWN){
-        return num_read;
+    struct rx_frame rx_frame;
+    int num_pushed = 0;
+    int res;
+    while ((res = can_recv_frame(can_port, &rx_frame)) > 0) {
+      if (!rx_ring_push(&can_port->rx_ring, &rx_frame)) {
+        __atomic_add_fetch(&can_port->stats.rx_ring_overflows, 1, __ATOMIC_RELAXED);
+        continue;
+      }
+      //don't sit on a long burst before telling main about it
+      if (++num_pushed == MAX_NOTIFY_FRAMES) {
+        wake_main(can_port);
+        num_pushed = 0;
       }
-      else
-        return -1;
-    } else {
-      encode_can_frame(can_port->read_buffer, resp_index, &can_frame);
     }
+    if (res < 0) {
+      __atomic_store_n(&can_port->reader_error, errno, __ATOMIC_RELEASE);
+      wake_main(can_port);
+      return NULL;
+    }
+    if (num_pushed > 0)
+      wake_main(can_port);
+  }
+}
+
+/**
+ * @brief Switch to threaded mode, reading the socket on its own thread
+ *
+ * @param ring_size frames buffered between the threads, rounded up to a power of two
+ * @return 0 on success, -1 on failure
+ */
+int can_start_reader(struct can_port *can_port, uint32_t ring_size)
+{
+  can_stop_reader(can_port);
+
+  if (rx_ring_init(&can_port->rx_ring, ring_size) < 0)
+    return -1;
+  can_port->reader_error = 0;
+  can_port->reader_notify_fd = eventfd(0, EFD_NONBLOCK);
+  can_port->reader_stop_fd = eventfd(0, EFD_NONBLOCK);
+  if (can_port->reader_notify_fd < 0 || can_port->reader_stop_fd < 0 ||
+      pthread_create(&can_port->reader, NULL, reader_thread, can_port) != 0) {
+    close(can_port->reader_notify_fd);
+    close(can_port->reader_stop_fd);
+    rx_ring_free(&can_port->rx_ring);
+    return -1;
+  }
+  can_port->threaded = true;
+  demote_main_thread(can_port);
+  return 0;
+}
+
+/**
+ * @brief Stop the reader thread, if running. Frames still in the ring are
+ * discarded.
+ */
+void can_stop_reader(struct can_port *can_port)
+{
+  if (!can_port->threaded)
+    return;
+
+  uint64_t one = 1;
+  if (write(can_port->reader_stop_fd, &one, sizeof(one)) < 0)
+    err(EXIT_FAILURE, "reader_stop_fd");
+  pthread_join(can_port->reader, NULL);
+
+  close(can_port->reader_notify_fd);
+  close(can_port->reader_stop_fd);
+  can_port->reader_notify_fd = -1;
+  can_port->reader_stop_fd = -1;
+  rx_ring_free(&can_port->rx_ring);
+  can_port->threaded = false;
+  //the main thread reads the socket itself again
+  realtime_apply_thread(pthread_self(), &can_port->realtime);
+}
+
+struct flush_state {
+  struct can_port *can_port;
+  int *resp_index;
+  int num_encoded;
+};
+
+static void encode_held_frame(void *cookie, struct can_frame *can_frame, enum rx_filter_result result)
+{
+  struct flush_state *flush = cookie;
+  if (result == RX_FILTER_UNCHANGED) {
+    flush->can_port->stats.rx_suppressed++;
+    return;
+  }
+  encode_can_frame(flush->can_port->read_buffer, flush->resp_index, can_frame);
+  flush->num_encoded++;
+}
+
+/**
+ * @brief Encode frames held by decimation windows that have now ended
+ *
+ * @return the number of frames encoded
+ */
+int can_flush_held_frames(struct can_port *can_port, int *resp_index)
+{
+  struct flush_state flush = { can_port, resp_index, 0 };
+  rx_filter_flush(&can_port->rx_filter, current_time(), encode_held_frame, &flush);
+  return flush.num_encoded;
+}
+
+void can_record_batch(struct can_port *can_port, int num_frames)
+{
+  can_port->stats.notifications++;
+  for (int i = 0; i < NUM_BATCH_BUCKETS; i++) {
+    if (num_frames <= batch_bucket_bounds[i]) {
+      can_port->stats.batch_hist[i]++;
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Buffer up to frames received frames per notification, sending
+ * a smaller one us microseconds after its first frame arrived
+ *
+ * @return 0 on success, -1 if frames is out of range or a batch has no time limit
+ */
+int can_set_coalesce(struct can_port *can_port, int frames, uint32_t us)
+{
+  if (frames < 1 || frames > MAX_NOTIFY_FRAMES || (frames > 1 && us == 0))
+    return -1;
+  can_port->coalesce_frames = frames;
+  can_port->coalesce_us = us;
+  return 0;
+}
+
+/**
+ * @brief Start coalesce_us counting down, or stop it
+ */
+void can_arm_coalesce_timer(struct can_port *can_port, bool armed)
+{
+  if (armed == can_port->coalesce_timer_armed)
+    return;
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (armed) {
+    spec.it_value.tv_sec = can_port->coalesce_us / 1000000;
+    spec.it_value.tv_nsec = (can_port->coalesce_us % 1000000) * 1000;
   }
-  return num_read;
+  //disarming also clears an expiry that hasn't been read yet
+  if (timerfd_settime(can_port->coalesce_timer_fd, 0, &spec, NULL) < 0)
+    err(EXIT_FAILURE, "timerfd_settime");
+  can_port->coalesce_timer_armed = armed;
 }
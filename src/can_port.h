@@ -5,21 +5,129 @@
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <linux/can/error.h>
+
+#include "flight_recorder.h"
+#include "realtime.h"
+#include "rx_filter.h"
+#include "rx_ring.h"
+#include "tx_queue.h"
+
+#include <pthread.h>
+#include <net/if.h>
 #define MAX_READBUF 100
 #define ENCODED_READ_FRAME_SIZE 27
 #define ENCODED_WRITE_FRAME_SIZE 20
+//most frames drained from the socket into one notification
+#define MAX_NOTIFY_FRAMES 1000
+//room for a full read, or for every held frame being released at once
+#define NOTIFY_BUFFER_SIZE (36 + (RX_FILTER_SLOTS * ENCODED_READ_FRAME_SIZE))
+//frames written and waiting for their echo when tx confirmations are on
+#define TX_PENDING_DEPTH 4096
+//notification batch sizes are bucketed by these upper bounds
+#define NUM_BATCH_BUCKETS 11
+extern const int batch_bucket_bounds[NUM_BATCH_BUCKETS];
+
+//counters are reset whenever the port is (re)opened
+struct can_stats {
+    uint64_t rx_frames;
+    uint64_t rx_bytes;
+    uint64_t tx_frames;
+    uint64_t tx_bytes;
+    //frames held back by the receive filter's change detection
+    uint64_t rx_suppressed;
+    //frames dropped by decimation rules
+    uint64_t rx_decimated;
+    //frames the kernel dropped because the receive queue was full (SO_RXQ_OVFL)
+    uint32_t rx_kernel_drops;
+    //times a read stopped because the notification was full with frames still queued
+    uint64_t rx_read_limit_hits;
+    //threaded mode: frames the reader thread discarded because rx_ring was full
+    uint64_t rx_ring_overflows;
+    //write() calls that failed with EAGAIN/ENOBUFS/ENETDOWN and were retried later
+    uint64_t tx_retries;
+    //queued frames discarded before they could be written
+    uint64_t tx_dropped;
+    //frames refused because their queue was full
+    uint64_t tx_rejected;
+    uint64_t tx_confirmed;
+    //written frames whose echo never matched up
+    uint64_t tx_confirm_lost;
+    uint64_t poll_wakeups;
+    //wakeups found by spinning in busy_poll() before poll() would have slept
+    uint64_t busy_poll_hits;
+    uint64_t notifications;
+    //notifications sent because coalesce_us ran out before coalesce_frames were buffered
+    uint64_t coalesce_timeouts;
+    uint64_t batch_hist[NUM_BATCH_BUCKETS];
+};
+
+//a written frame waiting for its echo
+struct tx_pending {
+    canid_t can_id;
+    uint32_t tag;
+    uint16_t index;
+};
+
+struct tx_confirmation {
+    uint32_t tag;
+    uint16_t index;
+    //when the frame left the controller, ns since the epoch
+    uint64_t timestamp;
+};
 
 struct can_port {
     // CAN file handle
     int fd;
+    char interface_name[IFNAMSIZ];
 
-    //write buffer
-    char *write_buffer;
-    //^const?
-    int write_buffer_size;
+    //frames waiting for POLLOUT, highest priority class first
+    struct tx_queue tx_queues[TX_NUM_CLASSES];
 
-    //read buffer stuff
+    //tx confirmations: own frames are echoed back and matched in order
+    bool tx_confirm;
+    struct tx_pending *tx_pending;
+    int tx_pending_head;
+    int tx_pending_count;
+    //filled while reading, sent after the received frames
+    struct tx_confirmation *confirmations;
+    int num_confirmations;
+
+    //read buffer stuff, allocated once and reused by every notification
     char *read_buffer;
+    //where the next frame goes in the notification being built, 0 if none
+    int batch_index;
+    int batch_frames;
+    //{:recording, ...} chunks and {:recording_saved, ...}
+    char *recording_buffer;
+
+    //send a notification once coalesce_frames are buffered, or coalesce_us
+    //after the first one; 1 sends every read straight away
+    int coalesce_frames;
+    uint32_t coalesce_us;
+    int coalesce_timer_fd;
+    bool coalesce_timer_armed;
+
+    //threaded mode: a reader thread drains the socket into rx_ring
+    bool threaded;
+    pthread_t reader;
+    struct rx_ring rx_ring;
+    //reader -> main: frames are waiting in rx_ring
+    int reader_notify_fd;
+    //main -> reader: exit
+    int reader_stop_fd;
+    //errno of a failed read on the reader thread, 0 if none
+    int reader_error;
+
+    //decides which received frames are forwarded
+    struct rx_filter rx_filter;
+
+    //every received frame, before filtering, for post-mortem dumps
+    struct flight_recorder recorder;
+
+    //scheduling, memory locking and busy polling for the port's threads
+    struct realtime_config realtime;
+
+    struct can_stats stats;
 };
 
 int can_open(struct can_port *port, char *interface_name, long *rcvbuf_size, long *sndbuf_size);
@@ -32,8 +140,41 @@ int can_close(struct can_port *port);
 
 int can_write(struct can_port *can_port, struct can_frame *can_frame);
 
+int can_send_frame(struct can_port *can_port, int tx_class, struct tx_frame *tx_frame);
+
+int can_drain_tx_queues(struct can_port *can_port);
+
+bool can_tx_pending(struct can_port *can_port);
+
+int can_set_tx_confirm(struct can_port *can_port, bool enabled);
+
+int can_tx_queue_depth(struct can_port *can_port);
+
+int can_set_realtime(struct can_port *can_port, struct realtime_config *config);
+
+int can_set_recorder(struct can_port *can_port, uint32_t capacity, uint64_t pre_ms, uint64_t post_ms,
+                     const struct recorder_trigger *triggers, int num_triggers, const char *path);
+
 int can_read(struct can_port *can_port, struct can_frame *can_frame);
 
-int can_read_into_buffer(struct can_port *can_port, int *resp_index);
+int can_read_into_buffer(struct can_port *can_port, int *resp_index, int max_frames);
+
+int can_read_ring_into_buffer(struct can_port *can_port, int *resp_index, int max_frames);
+
+int can_start_reader(struct can_port *can_port, uint32_t ring_size);
+
+void can_stop_reader(struct can_port *can_port);
+
+int can_reader_error(struct can_port *can_port);
+
+int can_flush_held_frames(struct can_port *can_port, int *resp_index);
+
+void can_record_batch(struct can_port *can_port, int num_frames);
+
+int can_set_coalesce(struct can_port *can_port, int frames, uint32_t us);
+
+void can_arm_coalesce_timer(struct can_port *can_port, bool armed);
 
 void encode_can_frame(char *resp, int *resp_index, struct can_frame *can_frame);
+
+struct can_frame parse_can_frame(const char *req, int *req_index);
@@ -0,0 +1,198 @@
+#include "flight_recorder.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void recorder_init(struct flight_recorder *recorder)
+{
+  memset(recorder, 0, sizeof(*recorder));
+}
+
+/**
+ * @brief (Re)start recording into a fresh ring of capacity frames
+ *
+ * @param post_ms how long to keep recording after a trigger, at most RECORDER_MAX_POST_MS
+ * @param path file to append dumps to, NULL to send them to Elixir
+ * @return 0 on success, -1 if out of memory or there are too many triggers
+ */
+int recorder_configure(struct flight_recorder *recorder, uint32_t capacity,
+                       uint64_t pre_ms, uint64_t post_ms,
+                       const struct recorder_trigger *triggers, int num_triggers,
+                       const char *path)
+{
+  recorder_disable(recorder);
+  if (capacity == 0 || num_triggers > RECORDER_MAX_TRIGGERS)
+    return -1;
+
+  recorder->frames = malloc(capacity * sizeof(struct recorded_frame));
+  recorder->path = path ? strdup(path) : NULL;
+  if (recorder->frames == NULL || (path && recorder->path == NULL)) {
+    recorder_disable(recorder);
+    return -1;
+  }
+  recorder->capacity = capacity;
+  recorder->pre_ns = pre_ms * 1000000ULL;
+  recorder->post_ms = post_ms > RECORDER_MAX_POST_MS ? RECORDER_MAX_POST_MS : post_ms;
+  memcpy(recorder->triggers, triggers, num_triggers * sizeof(struct recorder_trigger));
+  recorder->num_triggers = num_triggers;
+  recorder->enabled = true;
+  return 0;
+}
+
+void recorder_disable(struct flight_recorder *recorder)
+{
+  free(recorder->frames);
+  free(recorder->path);
+  recorder_init(recorder);
+}
+
+static bool trigger_matches(struct recorder_trigger *trigger, struct can_frame *can_frame)
+{
+  if (trigger->type == TRIGGER_ERROR_FRAME)
+    return (can_frame->can_id & CAN_ERR_FLAG) != 0;
+  if ((can_frame->can_id & trigger->mask) != (trigger->id & trigger->mask))
+    return false;
+  if (trigger->type == TRIGGER_PAYLOAD) {
+    for (int i = 0; i < 8; i++) {
+      if ((can_frame->data[i] & trigger->data_mask[i]) != (trigger->data[i] & trigger->data_mask[i]))
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Add a frame to the ring, overwriting the oldest when it's full,
+ * and fire the first trigger it matches
+ *
+ * @param timestamp ns since the epoch
+ */
+void recorder_record(struct flight_recorder *recorder, struct can_frame *can_frame, uint64_t timestamp)
+{
+  struct recorded_frame *recorded = &recorder->frames[recorder->head];
+  recorded->can_frame = *can_frame;
+  recorded->timestamp = timestamp;
+  recorder->head = (recorder->head + 1) % recorder->capacity;
+  if (recorder->count < recorder->capacity)
+    recorder->count++;
+
+  //triggers are ignored until the current window has been dumped
+  if (recorder->triggered)
+    return;
+  for (int i = 0; i < recorder->num_triggers; i++) {
+    if (trigger_matches(&recorder->triggers[i], can_frame)) {
+      recorder_trigger(recorder, recorder->triggers[i].type, can_frame->can_id, timestamp);
+      return;
+    }
+  }
+}
+
+void recorder_trigger(struct flight_recorder *recorder, enum recorder_trigger_type reason,
+                      canid_t can_id, uint64_t timestamp)
+{
+  if (recorder->triggered)
+    return;
+  recorder->triggered = true;
+  recorder->reason = reason;
+  recorder->reason_id = can_id;
+  recorder->triggered_at = timestamp;
+  recorder->dump_at = current_time() + recorder->post_ms;
+}
+
+//the window has been dumped, so triggers can fire again
+void recorder_rearm(struct flight_recorder *recorder)
+{
+  recorder->triggered = false;
+}
+
+/**
+ * @return ms until the post-trigger window ends, or -1 if nothing triggered
+ */
+int recorder_next_deadline(struct flight_recorder *recorder)
+{
+  if (!recorder->triggered)
+    return -1;
+  uint64_t now = current_time();
+  return recorder->dump_at <= now ? 0 : (int) (recorder->dump_at - now);
+}
+
+bool recorder_due(struct flight_recorder *recorder)
+{
+  return recorder->triggered && current_time() >= recorder->dump_at;
+}
+
+/**
+ * @return how many of the oldest frames in the ring came before the
+ * pre-trigger window. Frames from there to the newest make up the dump.
+ */
+uint32_t recorder_window_start(struct flight_recorder *recorder)
+{
+  uint64_t start = recorder->triggered_at > recorder->pre_ns ?
+                   recorder->triggered_at - recorder->pre_ns : 0;
+  uint32_t i = 0;
+  while (i < recorder->count && recorder_frame(recorder, i)->timestamp < start)
+    i++;
+  return i;
+}
+
+/**
+ * @return the ith oldest frame in the ring
+ */
+struct recorded_frame *recorder_frame(struct flight_recorder *recorder, uint32_t i)
+{
+  uint32_t oldest = (recorder->head + recorder->capacity - recorder->count) % recorder->capacity;
+  return &recorder->frames[(oldest + i) % recorder->capacity];
+}
+
+/**
+ * @brief Append the dump to recorder->path as a candump -L log
+ *
+ * @return the number of frames written, or -1 if the file couldn't be written
+ */
+int recorder_save(struct flight_recorder *recorder, const char *interface_name)
+{
+  FILE *fp = fopen(recorder->path, "a");
+  if (fp == NULL)
+    return -1;
+
+  uint32_t first = recorder_window_start(recorder);
+  for (uint32_t i = first; i < recorder->count; i++) {
+    struct recorded_frame *recorded = recorder_frame(recorder, i);
+    struct can_frame *can_frame = &recorded->can_frame;
+    fprintf(fp, "(%llu.%06llu) %s ",
+            (unsigned long long) (recorded->timestamp / 1000000000ULL),
+            (unsigned long long) ((recorded->timestamp % 1000000000ULL) / 1000),
+            interface_name);
+    if (can_frame->can_id & CAN_ERR_FLAG)
+      fprintf(fp, "%08X#", can_frame->can_id & (CAN_ERR_MASK | CAN_ERR_FLAG));
+    else if (can_frame->can_id & CAN_EFF_FLAG)
+      fprintf(fp, "%08X#", can_frame->can_id & CAN_EFF_MASK);
+    else
+      fprintf(fp, "%03X#", can_frame->can_id & CAN_SFF_MASK);
+
+    if (can_frame->can_id & CAN_RTR_FLAG) {
+      fputc('R', fp);
+    } else {
+      for (int j = 0; j < can_frame->can_dlc && j < 8; j++)
+        fprintf(fp, "%02X", can_frame->data[j]);
+    }
+    fputc('\n', fp);
+  }
+  if (fclose(fp) != 0)
+    return -1;
+  return recorder->count - first;
+}
+
+/**
+ * @return CLOCK_REALTIME in ns, for frames that came without a kernel timestamp
+ */
+uint64_t realtime_ns()
+{
+  struct timespec tp;
+  if (clock_gettime(CLOCK_REALTIME, &tp) < 0)
+    errx(EXIT_FAILURE, "clock_gettime failed?");
+  return ((uint64_t) tp.tv_sec) * 1000000000ULL + tp.tv_nsec;
+}
@@ -0,0 +1,100 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+#define RECORDER_MAX_TRIGGERS 16
+//frames per {:recording, ...} notification
+#define RECORDER_CHUNK_FRAMES 1000
+//{timestamp, can_id, <<data>>} plus the list cell
+#define ENCODED_RECORDED_FRAME_SIZE 40
+#define RECORDER_CHUNK_BUFFER_SIZE (64 + (RECORDER_CHUNK_FRAMES * ENCODED_RECORDED_FRAME_SIZE))
+//longer post-trigger windows are cut to this so the poll() timeout fits in an int
+#define RECORDER_MAX_POST_MS (24 * 60 * 60 * 1000ULL)
+
+enum recorder_trigger_type {
+    //(can_id & mask) == (id & mask)
+    TRIGGER_ID,
+    //as TRIGGER_ID, and the payload bits in data_mask equal data
+    TRIGGER_PAYLOAD,
+    TRIGGER_ERROR_FRAME,
+    //only used as a reason: trigger_recording was called
+    TRIGGER_MANUAL
+};
+
+struct recorder_trigger {
+    enum recorder_trigger_type type;
+    canid_t id;
+    canid_t mask;
+    uint8_t data[8];
+    uint8_t data_mask[8];
+};
+
+struct recorded_frame {
+    struct can_frame can_frame;
+    //ns since the epoch
+    uint64_t timestamp;
+};
+
+/*
+ * Keeps the last capacity frames. When a trigger fires, recording carries
+ * on for post_ms and then the frames from pre_ms before the trigger
+ * onwards are dumped in one go.
+ */
+struct flight_recorder {
+    bool enabled;
+    struct recorded_frame *frames;
+    uint32_t capacity;
+    //where the next frame goes
+    uint32_t head;
+    uint32_t count;
+
+    uint64_t pre_ns;
+    uint64_t post_ms;
+    struct recorder_trigger triggers[RECORDER_MAX_TRIGGERS];
+    int num_triggers;
+    //dump to this file in candump -L format, NULL to send to Elixir
+    char *path;
+
+    //a trigger fired and the post-trigger window is being recorded
+    bool triggered;
+    enum recorder_trigger_type reason;
+    canid_t reason_id;
+    //ns since the epoch, on the same clock as the frame timestamps
+    uint64_t triggered_at;
+    //current_time() when the window ends
+    uint64_t dump_at;
+};
+
+void recorder_init(struct flight_recorder *recorder);
+
+int recorder_configure(struct flight_recorder *recorder, uint32_t capacity,
+                       uint64_t pre_ms, uint64_t post_ms,
+                       const struct recorder_trigger *triggers, int num_triggers,
+                       const char *path);
+
+void recorder_disable(struct flight_recorder *recorder);
+
+void recorder_record(struct flight_recorder *recorder, struct can_frame *can_frame, uint64_t timestamp);
+
+void recorder_trigger(struct flight_recorder *recorder, enum recorder_trigger_type reason,
+                      canid_t can_id, uint64_t timestamp);
+
+void recorder_rearm(struct flight_recorder *recorder);
+
+int recorder_next_deadline(struct flight_recorder *recorder);
+
+bool recorder_due(struct flight_recorder *recorder);
+
+uint32_t recorder_window_start(struct flight_recorder *recorder);
+
+struct recorded_frame *recorder_frame(struct flight_recorder *recorder, uint32_t i);
+
+int recorder_save(struct flight_recorder *recorder, const char *interface_name);
+
+uint64_t realtime_ns();
+
+#endif // FLIGHT_RECORDER_H
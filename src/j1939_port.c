@@ -0,0 +1,226 @@
+#include "j1939_port.h"
+#include "util.h"
+#include "erlcmd.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+
+int j1939_init(struct j1939_port **pport)
+{
+    struct j1939_port *port = malloc(sizeof(struct j1939_port));
+    *pport = port;
+    if (port == NULL)
+      return -1;
+
+    port->fd = -1;
+    port->send_priority = J1939_DEFAULT_PRIORITY;
+    port->rx_truncated = 0;
+  port->read_error = 0;
+    port->read_error = 0;
+    port->message = malloc(J1939_MAX_MESSAGE);
+    port->read_buffer = malloc(J1939_NOTIFY_BUFFER_SIZE);
+    if (port->message == NULL || port->read_buffer == NULL)
+      return -1;
+    return 0;
+}
+
+int j1939_is_open(struct j1939_port *port)
+{
+    return port->fd != -1;
+}
+
+void j1939_close(struct j1939_port *port)
+{
+  close(port->fd);
+  port->fd = -1;
+}
+
+/**
+ * @brief Announce that config->name is using config->addr. The kernel
+ * tracks claims on the bus from then on, including one that takes the
+ * address away from us.
+ */
+static int send_address_claim(struct j1939_port *port, name_t name)
+{
+  uint8_t data[8];
+  //NAME goes out little-endian
+  for (int i = 0; i < 8; i++)
+    data[i] = (name >> (8 * i)) & 0xff;
+  return j1939_send(port, J1939_PGN_ADDRESS_CLAIMED, J1939_NO_ADDR,
+                    J1939_DEFAULT_PRIORITY, data, sizeof(data));
+}
+
+/**
+ * @brief Open a CAN_J1939 socket. Transport protocol sessions and address
+ * claim tracking are handled by the kernel, so reads return whole messages.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int j1939_open(struct j1939_port *port, char *interface_name, struct j1939_config *config)
+{
+  int s;
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+
+  if ((s = socket(PF_CAN, SOCK_DGRAM, CAN_J1939)) < 0)
+    return -1;
+
+  int flags = fcntl(s, F_GETFL, 0);
+  fcntl(s, F_SETFL, flags | O_NONBLOCK);
+  port->fd = s;
+  port->send_priority = J1939_DEFAULT_PRIORITY;
+  port->rx_truncated = 0;
+  port->read_error = 0;
+
+  strcpy(ifr.ifr_name, interface_name);
+  if (ioctl(s, SIOCGIFINDEX, &ifr) < 0)
+    goto fail;
+
+  //address claims and most PGNs are broadcast
+  int enable = 1;
+  if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable)) < 0)
+    goto fail;
+  if (config->promisc &&
+      setsockopt(s, SOL_CAN_J1939, SO_J1939_PROMISC, &enable, sizeof(enable)) < 0)
+    goto fail;
+  if (config->num_filters > 0 &&
+      setsockopt(s, SOL_CAN_J1939, SO_J1939_FILTER, config->filters,
+                 config->num_filters * sizeof(struct j1939_filter)) < 0)
+    goto fail;
+  if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf_size, sizeof(config->rcvbuf_size)) < 0)
+    goto fail;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  addr.can_addr.j1939.name = config->name;
+  addr.can_addr.j1939.pgn = J1939_NO_PGN;
+  addr.can_addr.j1939.addr = config->addr;
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    goto fail;
+
+  if (config->name != J1939_NO_NAME && config->addr != J1939_NO_ADDR &&
+      send_address_claim(port, config->name) < 0)
+    goto fail;
+  return 0;
+
+fail:
+  {
+    int open_errno = errno;
+    j1939_close(port);
+    errno = open_errno;
+  }
+  return -1;
+}
+
+/**
+ * @brief Send one message. Anything over 8 bytes goes out as a transport
+ * protocol session run by the kernel.
+ *
+ * @param dest destination address, J1939_NO_ADDR to broadcast
+ * @return 0 on success, -1 with errno set
+ */
+int j1939_send(struct j1939_port *port, pgn_t pgn, uint8_t dest, int priority,
+               const uint8_t *data, int len)
+{
+  //priority is per socket, so only touch it when it changes
+  if (priority != port->send_priority) {
+    if (setsockopt(port->fd, SOL_CAN_J1939, SO_J1939_SEND_PRIO, &priority, sizeof(priority)) < 0)
+      return -1;
+    port->send_priority = priority;
+  }
+
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_addr.j1939.name = J1939_NO_NAME;
+  addr.can_addr.j1939.pgn = pgn;
+  addr.can_addr.j1939.addr = dest;
+  if (sendto(port->fd, data, len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return -1;
+  return 0;
+}
+
+static void encode_j1939_message(char *resp, int *resp_index, pgn_t pgn, uint8_t src,
+                                 uint8_t dest, uint8_t priority, const uint8_t *data, int len)
+{
+  ei_encode_list_header(resp, resp_index, 1);
+  ei_encode_tuple_header(resp, resp_index, 5);
+  ei_encode_ulong(resp, resp_index, pgn);
+  ei_encode_ulong(resp, resp_index, src);
+  ei_encode_ulong(resp, resp_index, dest);
+  ei_encode_ulong(resp, resp_index, priority);
+  ei_encode_binary(resp, resp_index, data, len);
+}
+
+/**
+ * @brief Read whole messages into port->read_buffer until the socket is
+ * empty or another message might not fit. A read error after some
+ * messages were encoded is reported by the next call instead, so they
+ * still get sent.
+ *
+ * @return the number of messages encoded, or -1 on a read error with errno set
+ */
+int j1939_read_into_buffer(struct j1939_port *port, int *resp_index)
+{
+  if (port->read_error != 0) {
+    errno = port->read_error;
+    port->read_error = 0;
+    return -1;
+  }
+
+  int num_encoded = 0;
+  //leave room for the list tail and message count too
+  while (*resp_index + J1939_MAX_ENCODED_MESSAGE + 16 <= J1939_NOTIFY_BUFFER_SIZE) {
+    struct sockaddr_can src;
+    struct iovec iov = { port->message, J1939_MAX_MESSAGE };
+    char control[CMSG_SPACE(sizeof(uint8_t)) + CMSG_SPACE(sizeof(name_t)) +
+                 CMSG_SPACE(sizeof(priority_t))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(port->fd, &msg, 0);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return num_encoded;
+      if (num_encoded == 0)
+        return -1;
+      port->read_error = errno;
+      return num_encoded;
+    }
+    //extended transport protocol messages are bigger than we deliver
+    if (msg.msg_flags & MSG_TRUNC) {
+      port->rx_truncated++;
+      continue;
+    }
+
+    uint8_t dest = J1939_NO_ADDR;
+    uint8_t priority = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_CAN_J1939)
+        continue;
+      if (cmsg->cmsg_type == SCM_J1939_DEST_ADDR)
+        memcpy(&dest, CMSG_DATA(cmsg), sizeof(dest));
+      else if (cmsg->cmsg_type == SCM_J1939_PRIO)
+        memcpy(&priority, CMSG_DATA(cmsg), sizeof(priority));
+    }
+
+    encode_j1939_message(port->read_buffer, resp_index, src.can_addr.j1939.pgn,
+                         src.can_addr.j1939.addr, dest, priority, port->message, len);
+    num_encoded++;
+  }
+  return num_encoded;
+}
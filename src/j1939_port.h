@@ -0,0 +1,57 @@
+#ifndef J1939_PORT_H
+#define J1939_PORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+#include <linux/can/j1939.h>
+
+//largest message the kernel's transport protocol (TP) reassembles
+#define J1939_MAX_MESSAGE 1785
+//{pgn, source, destination, priority, <<data>>} headers around the payload
+#define J1939_ENCODED_MESSAGE_OVERHEAD 32
+#define J1939_MAX_ENCODED_MESSAGE (J1939_MAX_MESSAGE + J1939_ENCODED_MESSAGE_OVERHEAD)
+//a notification has to fit in a {:packet, 2} message
+#define J1939_NOTIFY_BUFFER_SIZE 65000
+#define J1939_DEFAULT_PRIORITY 6
+
+struct j1939_config {
+    //NAME to claim addr with, J1939_NO_NAME to use addr without claiming it
+    name_t name;
+    //source address, J1939_NO_ADDR to only receive
+    uint8_t addr;
+    //receive everything on the bus, not just messages to addr or broadcast
+    bool promisc;
+    long rcvbuf_size;
+    struct j1939_filter *filters;
+    int num_filters;
+};
+
+struct j1939_port {
+    int fd;
+    //SO_J1939_SEND_PRIO currently set on the socket
+    int send_priority;
+    //one reassembled message, before it's encoded
+    uint8_t *message;
+    char *read_buffer;
+    //messages dropped for being bigger than J1939_MAX_MESSAGE
+    uint64_t rx_truncated;
+    //errno of a read error held back so the messages read before it went out
+    int read_error;
+};
+
+int j1939_init(struct j1939_port **pport);
+
+int j1939_is_open(struct j1939_port *port);
+
+int j1939_open(struct j1939_port *port, char *interface_name, struct j1939_config *config);
+
+void j1939_close(struct j1939_port *port);
+
+int j1939_send(struct j1939_port *port, pgn_t pgn, uint8_t dest, int priority,
+               const uint8_t *data, int len);
+
+int j1939_read_into_buffer(struct j1939_port *port, int *resp_index);
+
+#endif // J1939_PORT_H
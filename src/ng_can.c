@@ -5,12 +5,14 @@
 #include "erlcmd.h"
 #include "util.h"
 #include "can_port.h"
+#include "j1939_port.h"
 
 #include <poll.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 
 struct request_handler {
   const char *name;
@@ -18,6 +20,7 @@ struct request_handler {
 };
 
 static struct can_port *can_port = NULL;
+static struct j1939_port *j1939_port = NULL;
 
 // Utilities
 static const char response_id = 'r';
@@ -54,71 +57,542 @@ static void send_error_notification(const char *reason)
   erlcmd_send(resp, resp_index);
 }
 
-static struct can_frame parse_can_frame(const char *req, int *req_index)
+static void fail_write()
 {
-    struct can_frame can_frame;
-    int num_tuple_elements;
-    if(ei_decode_tuple_header(req, req_index, &num_tuple_elements) < 0 || num_tuple_elements != 2)
-      errx(EXIT_FAILURE, "Bad Tuple");
-    unsigned long id;
-    if (ei_decode_ulong(req, req_index, &id) < 0)
-      errx(EXIT_FAILURE, "Bad Can ID");
-    long data_len;
-    char data[8] = "";
-    if(ei_decode_binary(req, req_index, data, &data_len) < 0 || data_len != 8)
-      errx(EXIT_FAILURE, "Bad Data");
+  char *err_str[64];
+  sprintf(err_str, "write() error: %d", errno);
+  send_error_notification(err_str);
+  errx(EXIT_FAILURE, err_str);
+}
 
-    can_frame.can_id = id;
-    can_frame.can_dlc = data_len;
-    memcpy(can_frame.data, data, 8);
-    return can_frame;
+/**
+ * @brief Send :ok, or {:error, {:tx_queue_full, num_rejected}} if the
+ * last num_rejected frames of the batch didn't fit in their queue
+ */
+static void send_write_response(int num_rejected)
+{
+  if (num_rejected == 0) {
+    send_ok_response();
+    return;
+  }
+  char resp[256];
+  int resp_index = sizeof(uint16_t); // Space for payload size
+  resp[resp_index++] = response_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "error");
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "tx_queue_full");
+  ei_encode_long(resp, &resp_index, num_rejected);
+  erlcmd_send(resp, resp_index);
 }
 
-static int write_buffer(const char *req, int *req_index, int num_frames)
+/**
+ * @brief Make sure a {:notif, frames, num_frames} message is being built
+ * in can_port->read_buffer, encoding frames at can_port->batch_index
+ *
+ * @return how many more frames fit in it
+ */
+static int start_notification()
 {
-  for (int i = 0; i < num_frames; i++) {
-    int this_frame_offset = *req_index;
-    struct can_frame can_frame = parse_can_frame(req, req_index);
-    int write_result = can_write(can_port, &can_frame);
-
-    //ENETDOWN is okay since we're restarting using `ip link` in ng_can.ex?
-    if(write_result < 0 && (errno == EAGAIN || errno == ENOBUFS || errno == ENETDOWN)) {
-      //enqueue the remaining frames
-      int num_unsent = num_frames - i;
-      can_port->write_buffer_size = num_unsent;
-      int num_bytes = ENCODED_WRITE_FRAME_SIZE * num_unsent;
-      char *buffer = malloc(num_bytes);
-      memcpy(buffer, req + this_frame_offset, num_bytes);
-      free(can_port->write_buffer);
-      can_port->write_buffer = buffer;
-      return -1;
-    } else if(write_result < 0) {
-      char *err_str[64];
-      sprintf(err_str, "write() error: %d", errno);
-      send_error_notification(err_str);
-      errx(EXIT_FAILURE, err_str);
-    }
+  if (can_port->batch_index == 0) {
+    int resp_index = sizeof(uint16_t);
+    can_port->read_buffer[resp_index++] = notification_id;
+    ei_encode_version(can_port->read_buffer, &resp_index);
+    ei_encode_tuple_header(can_port->read_buffer, &resp_index, 3);
+    ei_encode_atom(can_port->read_buffer, &resp_index, "notif");
+    can_port->batch_index = resp_index;
+    can_port->batch_frames = 0;
   }
-  return 0;
+  return MAX_NOTIFY_FRAMES - can_port->batch_frames;
 }
 
-//request is an array of maps with keys {:id, :data, :data_size}
+//sends the notification being built, unless everything was filtered out
+static void send_notification()
+{
+  can_arm_coalesce_timer(can_port, false);
+  if (can_port->batch_frames > 0) {
+    int resp_index = can_port->batch_index;
+    can_record_batch(can_port, can_port->batch_frames);
+    ei_encode_empty_list(can_port->read_buffer, &resp_index);
+    ei_encode_ulong(can_port->read_buffer, &resp_index, can_port->batch_frames);
+    erlcmd_send(can_port->read_buffer, resp_index);
+  }
+  can_port->batch_index = 0;
+  can_port->batch_frames = 0;
+}
+
+/**
+ * @brief Count num_frames just encoded, and send the notification once it
+ * has coalesce_frames. Otherwise it goes out when the timer runs out.
+ */
+static void finish_notification(int num_frames)
+{
+  can_port->batch_frames += num_frames;
+  if (can_port->batch_frames >= can_port->coalesce_frames)
+    send_notification();
+  else if (can_port->batch_frames > 0)
+    can_arm_coalesce_timer(can_port, true);
+}
+
+//request is {tx_class, tag, [{can_id, <<data::8 bytes>>}]}, tag is 0 for no confirmation
 static void handle_write(const char *req, int *req_index)
 {
+  int arity;
+  long tx_class;
+  unsigned long tag;
+  if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 3 ||
+      ei_decode_long(req, req_index, &tx_class) < 0 ||
+      tx_class < 0 || tx_class >= TX_NUM_CLASSES ||
+      ei_decode_ulong(req, req_index, &tag) < 0)
+    errx(EXIT_FAILURE, "Expecting {tx_class, tag, frames}");
+
   int num_frames;
   if(ei_decode_list_header(req, req_index, &num_frames) < 0)
     errx(EXIT_FAILURE, "Expecting a list of frames");
-  write_buffer(req, req_index, num_frames);
+  //e.g. after a failed open_j1939 closed it
+  if (!can_is_open(can_port)) {
+    send_error_notification("can socket not open");
+    return;
+  }
+
+  int num_rejected = 0;
+  for (int i = 0; i < num_frames; i++) {
+    struct tx_frame tx_frame;
+    tx_frame.can_frame = parse_can_frame(req, req_index);
+    tx_frame.tag = tag;
+    tx_frame.index = i;
+    int result = can_send_frame(can_port, tx_class, &tx_frame);
+    if (result < 0)
+      fail_write();
+    num_rejected += result;
+  }
+  send_write_response(num_rejected);
+}
+
+//request is a list of {depth, :reject | :drop_oldest}, one per class
+static void handle_tx_queues(const char *req, int *req_index)
+{
+  int num_classes;
+  if (ei_decode_list_header(req, req_index, &num_classes) < 0 || num_classes != TX_NUM_CLASSES)
+    errx(EXIT_FAILURE, "expecting one tx queue config per class");
+
+  for (int i = 0; i < TX_NUM_CLASSES; i++) {
+    int arity;
+    long depth;
+    char policy[MAXATOMLEN];
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 2 ||
+        ei_decode_long(req, req_index, &depth) < 0 || depth <= 0 ||
+        ei_decode_atom(req, req_index, policy) < 0)
+      errx(EXIT_FAILURE, "expecting {depth, policy}");
+
+    enum tx_policy tx_policy;
+    if (strcmp(policy, "reject") == 0)
+      tx_policy = TX_POLICY_REJECT;
+    else if (strcmp(policy, "drop_oldest") == 0)
+      tx_policy = TX_POLICY_DROP_OLDEST;
+    else
+      errx(EXIT_FAILURE, "unknown tx queue policy: %s", policy);
+
+    can_port->stats.tx_dropped += tx_queue_configure(&can_port->tx_queues[i], depth, tx_policy);
+  }
+  send_ok_response();
+}
+
+//request is true or false
+static void handle_tx_confirm(const char *req, int *req_index)
+{
+  int enabled;
+  if (ei_decode_boolean(req, req_index, &enabled) < 0)
+    errx(EXIT_FAILURE, "expecting a boolean");
+  if (can_set_tx_confirm(can_port, enabled) < 0) {
+    send_error_notification("can't enable tx confirmations");
+    return;
+  }
+  send_ok_response();
+}
+
+//request is false, or the ring size for threaded mode
+static void handle_threaded(const char *req, int *req_index)
+{
+  int enabled;
+  int bool_index = *req_index;
+  if (ei_decode_boolean(req, &bool_index, &enabled) == 0 && !enabled) {
+    can_stop_reader(can_port);
+    send_ok_response();
+    return;
+  }
+
+  unsigned long ring_size;
+  if (ei_decode_ulong(req, req_index, &ring_size) < 0 || ring_size == 0)
+    errx(EXIT_FAILURE, "expecting false or a ring size");
+  //checked before narrowing to the ring's uint32_t size
+  if (ring_size > RX_RING_MAX_SIZE) {
+    send_error_notification("ring size too large");
+    return;
+  }
+  if (!can_is_open(can_port) || can_start_reader(can_port, ring_size) < 0) {
+    send_error_notification("can't start reader thread");
+    return;
+  }
+  send_ok_response();
+}
+
+//request is {max_frames, max_delay_us}
+static void handle_coalesce(const char *req, int *req_index)
+{
+  int arity;
+  unsigned long frames;
+  unsigned long us;
+  if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 2 ||
+      ei_decode_ulong(req, req_index, &frames) < 0 ||
+      ei_decode_ulong(req, req_index, &us) < 0)
+    errx(EXIT_FAILURE, "expecting {max_frames, max_delay_us}");
+
+  //frames already buffered go out under the old limits
+  send_notification();
+  if (frames > MAX_NOTIFY_FRAMES || can_set_coalesce(can_port, frames, us) < 0) {
+    send_error_notification("bad coalesce limits");
+    return;
+  }
+  send_ok_response();
+}
+
+//errno values a J1939 write can run into, as atoms
+static const char *errno_atom(int error)
+{
+  switch (error) {
+  case EAGAIN: return "eagain";
+  case ENOBUFS: return "enobufs";
+  case EBUSY: return "ebusy";
+  case ENETDOWN: return "enetdown";
+  case EMSGSIZE: return "emsgsize";
+  //no address, or another ECU claimed ours
+  case EADDRNOTAVAIL: return "eaddrnotavail";
+  case EHOSTUNREACH: return "ehostunreach";
+  case EPROTO: return "eproto";
+  default: return "eio";
+  }
+}
+
+//request is {interface, rcvbuf, name, addr, promisc, [{name, name_mask, pgn, pgn_mask, addr, addr_mask}]}
+static void handle_j1939_open(const char *req, int *req_index)
+{
+  int arity;
+  char interface_name[64];
+  long binary_len;
+  unsigned long long name;
+  unsigned long addr;
+  int promisc;
+  struct j1939_config config;
+  if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 6 ||
+      ei_decode_binary(req, req_index, interface_name, &binary_len) < 0 ||
+      ei_decode_long(req, req_index, &config.rcvbuf_size) < 0 ||
+      ei_decode_ulonglong(req, req_index, &name) < 0 ||
+      ei_decode_ulong(req, req_index, &addr) < 0 || addr > J1939_NO_ADDR ||
+      ei_decode_boolean(req, req_index, &promisc) < 0)
+    errx(EXIT_FAILURE, "expecting {interface, rcvbuf, name, addr, promisc, filters}");
+  interface_name[binary_len] = '\0';
+  config.name = name;
+  config.addr = addr;
+  config.promisc = promisc;
+
+  if (ei_decode_list_header(req, req_index, &config.num_filters) < 0)
+    errx(EXIT_FAILURE, "expecting a list of filters");
+  if (config.num_filters > J1939_FILTER_MAX) {
+    send_error_notification("too many j1939 filters");
+    return;
+  }
+  struct j1939_filter filters[J1939_FILTER_MAX];
+  for (int i = 0; i < config.num_filters; i++) {
+    unsigned long long filter_name, name_mask;
+    unsigned long pgn, pgn_mask, filter_addr, addr_mask;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 6 ||
+        ei_decode_ulonglong(req, req_index, &filter_name) < 0 ||
+        ei_decode_ulonglong(req, req_index, &name_mask) < 0 ||
+        ei_decode_ulong(req, req_index, &pgn) < 0 ||
+        ei_decode_ulong(req, req_index, &pgn_mask) < 0 ||
+        ei_decode_ulong(req, req_index, &filter_addr) < 0 ||
+        ei_decode_ulong(req, req_index, &addr_mask) < 0)
+      errx(EXIT_FAILURE, "expecting {name, name_mask, pgn, pgn_mask, addr, addr_mask}");
+    filters[i].name = filter_name;
+    filters[i].name_mask = name_mask;
+    filters[i].pgn = pgn;
+    filters[i].pgn_mask = pgn_mask;
+    filters[i].addr = filter_addr;
+    filters[i].addr_mask = addr_mask;
+  }
+  config.filters = filters;
+
+  //a port carries one channel, raw or J1939
+  if (can_is_open(can_port)) {
+    send_notification();
+    can_close(can_port);
+  }
+  if (j1939_is_open(j1939_port))
+    j1939_close(j1939_port);
+  //held frames would otherwise be flushed later as raw frames, and the
+  //counters start over as they do when a raw channel is opened
+  rx_filter_clear(&can_port->rx_filter);
+  memset(&can_port->stats, 0, sizeof(can_port->stats));
+
+  if (j1939_open(j1939_port, interface_name, &config) < 0) {
+    send_error_notification("error opening j1939 socket");
+    return;
+  }
+  send_ok_response();
+}
+
+/**
+ * @brief Reply {:error, {reason, num_sent}} when a J1939 write stops early
+ */
+static void send_j1939_write_error(const char *reason, int num_sent)
+{
+  char resp[256];
+  int resp_index = sizeof(uint16_t); // Space for payload size
+  resp[resp_index++] = response_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "error");
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, reason);
+  ei_encode_long(resp, &resp_index, num_sent);
+  erlcmd_send(resp, resp_index);
+}
+
+//request is [{pgn, dest, priority, <<data>>}], sent in order until one fails
+static void handle_j1939_write(const char *req, int *req_index)
+{
+  int num_messages;
+  if (ei_decode_list_header(req, req_index, &num_messages) < 0)
+    errx(EXIT_FAILURE, "expecting a list of j1939 messages");
+  if (!j1939_is_open(j1939_port)) {
+    send_error_notification("j1939 socket not open");
+    return;
+  }
+
+  uint8_t data[J1939_MAX_MESSAGE];
+  for (int i = 0; i < num_messages; i++) {
+    int arity, type, size;
+    unsigned long pgn, dest, priority;
+    long data_len;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 4 ||
+        ei_decode_ulong(req, req_index, &pgn) < 0 || pgn > J1939_PGN_MAX ||
+        ei_decode_ulong(req, req_index, &dest) < 0 || dest > J1939_NO_ADDR ||
+        ei_decode_ulong(req, req_index, &priority) < 0 || priority > 7 ||
+        ei_get_type(req, req_index, &type, &size) < 0 || type != ERL_BINARY_EXT)
+      errx(EXIT_FAILURE, "expecting {pgn, dest, priority, data}");
+    if (size > J1939_MAX_MESSAGE) {
+      send_j1939_write_error("emsgsize", i);
+      return;
+    }
+    if (ei_decode_binary(req, req_index, data, &data_len) < 0)
+      errx(EXIT_FAILURE, "bad j1939 data");
+
+    if (j1939_send(j1939_port, pgn, dest, priority, data, data_len) < 0) {
+      send_j1939_write_error(errno_atom(errno), i);
+      return;
+    }
+  }
+  send_ok_response();
+}
+
+//request is :off or {capacity, pre_ms, post_ms, triggers, path | nil}
+static void handle_recorder(const char *req, int *req_index)
+{
+  char atom[MAXATOMLEN];
+  int atom_index = *req_index;
+  if (ei_decode_atom(req, &atom_index, atom) == 0 && strcmp(atom, "off") == 0) {
+    can_set_recorder(can_port, 0, 0, 0, NULL, 0, NULL);
+    send_ok_response();
+    return;
+  }
+
+  int arity;
+  unsigned long capacity, pre_ms, post_ms;
+  int num_triggers;
+  if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 5 ||
+      ei_decode_ulong(req, req_index, &capacity) < 0 ||
+      ei_decode_ulong(req, req_index, &pre_ms) < 0 ||
+      ei_decode_ulong(req, req_index, &post_ms) < 0 ||
+      ei_decode_list_header(req, req_index, &num_triggers) < 0)
+    errx(EXIT_FAILURE, "expecting {capacity, pre_ms, post_ms, triggers, path}");
+  if (num_triggers > RECORDER_MAX_TRIGGERS) {
+    send_error_notification("too many recorder triggers");
+    return;
+  }
+
+  struct recorder_trigger triggers[RECORDER_MAX_TRIGGERS];
+  memset(triggers, 0, sizeof(triggers));
+  for (int i = 0; i < num_triggers; i++) {
+    struct recorder_trigger *trigger = &triggers[i];
+    atom_index = *req_index;
+    if (ei_decode_atom(req, &atom_index, atom) == 0 && strcmp(atom, "error_frame") == 0) {
+      trigger->type = TRIGGER_ERROR_FRAME;
+      *req_index = atom_index;
+      continue;
+    }
+
+    //{:id, id, mask} or {:payload, id, mask, <<data::8 bytes>>, <<data_mask::8 bytes>>}
+    unsigned long id, mask;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+        ei_decode_atom(req, req_index, atom) < 0 ||
+        ei_decode_ulong(req, req_index, &id) < 0 ||
+        ei_decode_ulong(req, req_index, &mask) < 0)
+      errx(EXIT_FAILURE, "expecting a recorder trigger");
+    trigger->id = id;
+    trigger->mask = mask;
+    if (strcmp(atom, "id") == 0 && arity == 3) {
+      trigger->type = TRIGGER_ID;
+    } else if (strcmp(atom, "payload") == 0 && arity == 5) {
+      long data_len, data_mask_len;
+      trigger->type = TRIGGER_PAYLOAD;
+      if (ei_decode_binary(req, req_index, trigger->data, &data_len) < 0 || data_len != 8 ||
+          ei_decode_binary(req, req_index, trigger->data_mask, &data_mask_len) < 0 || data_mask_len != 8)
+        errx(EXIT_FAILURE, "expecting 8 byte payload and mask");
+    } else {
+      errx(EXIT_FAILURE, "unknown recorder trigger: %s", atom);
+    }
+  }
+  int tail;
+  if (num_triggers > 0 && (ei_decode_list_header(req, req_index, &tail) < 0 || tail != 0))
+    errx(EXIT_FAILURE, "expecting the end of the trigger list");
+
+  char path[PATH_MAX];
+  char *dump_path = NULL;
+  int type, size;
+  if (ei_get_type(req, req_index, &type, &size) == 0 && type == ERL_BINARY_EXT) {
+    long path_len;
+    if (size >= PATH_MAX || ei_decode_binary(req, req_index, path, &path_len) < 0)
+      errx(EXIT_FAILURE, "bad recorder path");
+    path[path_len] = '\0';
+    dump_path = path;
+  }
+
+  if (capacity == 0 ||
+      can_set_recorder(can_port, capacity, pre_ms, post_ms, triggers, num_triggers, dump_path) < 0) {
+    send_error_notification("can't start flight recorder");
+    return;
+  }
+  send_ok_response();
+}
+
+//request is {priority, cpu, lock_memory, busy_poll_us}, each -1 (REALTIME_UNCHANGED) to leave it be
+static void handle_realtime(const char *req, int *req_index)
+{
+  int arity;
+  long priority, cpu, lock_memory, busy_poll_us;
+  if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 4 ||
+      ei_decode_long(req, req_index, &priority) < 0 ||
+      ei_decode_long(req, req_index, &cpu) < 0 ||
+      ei_decode_long(req, req_index, &lock_memory) < 0 ||
+      ei_decode_long(req, req_index, &busy_poll_us) < 0 ||
+      busy_poll_us < REALTIME_UNCHANGED || busy_poll_us > INT_MAX)
+    errx(EXIT_FAILURE, "expecting {priority, cpu, lock_memory, busy_poll_us}");
+
+  struct realtime_config config = { priority, cpu, lock_memory, busy_poll_us };
+  int failed = can_set_realtime(can_port, &config);
+  if (failed == 0) {
+    send_ok_response();
+    return;
+  }
+
+  //{:error, {:realtime_failed, [:priority | :cpu | :lock_memory]}}
+  char resp[256];
+  int resp_index = sizeof(uint16_t); // Space for payload size
+  resp[resp_index++] = response_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "error");
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "realtime_failed");
+  if (failed & REALTIME_FAILED_PRIORITY) {
+    ei_encode_list_header(resp, &resp_index, 1);
+    ei_encode_atom(resp, &resp_index, "priority");
+  }
+  if (failed & REALTIME_FAILED_CPU) {
+    ei_encode_list_header(resp, &resp_index, 1);
+    ei_encode_atom(resp, &resp_index, "cpu");
+  }
+  if (failed & REALTIME_FAILED_LOCK_MEMORY) {
+    ei_encode_list_header(resp, &resp_index, 1);
+    ei_encode_atom(resp, &resp_index, "lock_memory");
+  }
+  ei_encode_empty_list(resp, &resp_index);
+  erlcmd_send(resp, resp_index);
+}
+
+//request is ignored; fires the recorder as if a trigger had matched
+static void handle_record_trigger(const char *req, int *req_index)
+{
+  if (!can_port->recorder.enabled) {
+    send_error_notification("flight recorder not running");
+    return;
+  }
+  recorder_trigger(&can_port->recorder, TRIGGER_MANUAL, 0, realtime_ns());
   send_ok_response();
 }
 
-static void process_write_buffer()
+static void process_tx_queues()
 {
-  int req_index = 0;
-  if(write_buffer(can_port->write_buffer, &req_index, can_port->write_buffer_size) == 0){
-    free(can_port->write_buffer);
-    can_port->write_buffer_size = 0;
+  if (can_drain_tx_queues(can_port) < 0)
+    fail_write();
+}
+
+static void encode_stat(char *resp, int *resp_index, const char *name, uint64_t value)
+{
+  ei_encode_tuple_header(resp, resp_index, 2);
+  ei_encode_atom(resp, resp_index, name);
+  ei_encode_ulonglong(resp, resp_index, value);
+}
+
+//replies with a keyword list of the counters in struct can_stats
+static void handle_stats(const char *req, int *req_index)
+{
+  char resp[1024];
+  int resp_index = sizeof(uint16_t); // Space for payload size
+  struct can_stats *stats = &can_port->stats;
+  resp[resp_index++] = response_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_list_header(resp, &resp_index, 22);
+  encode_stat(resp, &resp_index, "rx_frames", stats->rx_frames);
+  encode_stat(resp, &resp_index, "rx_bytes", stats->rx_bytes);
+  encode_stat(resp, &resp_index, "tx_frames", stats->tx_frames);
+  encode_stat(resp, &resp_index, "tx_bytes", stats->tx_bytes);
+  encode_stat(resp, &resp_index, "rx_suppressed", stats->rx_suppressed);
+  encode_stat(resp, &resp_index, "rx_decimated", stats->rx_decimated);
+  encode_stat(resp, &resp_index, "rx_filter_full", can_port->rx_filter.table_full);
+  encode_stat(resp, &resp_index, "rx_kernel_drops",
+              __atomic_load_n(&stats->rx_kernel_drops, __ATOMIC_RELAXED));
+  encode_stat(resp, &resp_index, "rx_read_limit_hits", stats->rx_read_limit_hits);
+  encode_stat(resp, &resp_index, "rx_ring_overflows",
+              __atomic_load_n(&stats->rx_ring_overflows, __ATOMIC_RELAXED));
+  encode_stat(resp, &resp_index, "rx_j1939_truncated", j1939_port->rx_truncated);
+  encode_stat(resp, &resp_index, "tx_retries", stats->tx_retries);
+  encode_stat(resp, &resp_index, "tx_dropped", stats->tx_dropped);
+  encode_stat(resp, &resp_index, "tx_rejected", stats->tx_rejected);
+  encode_stat(resp, &resp_index, "tx_confirmed", stats->tx_confirmed);
+  encode_stat(resp, &resp_index, "tx_confirm_lost", stats->tx_confirm_lost);
+  encode_stat(resp, &resp_index, "tx_queue_depth", can_tx_queue_depth(can_port));
+  encode_stat(resp, &resp_index, "poll_wakeups", stats->poll_wakeups);
+  encode_stat(resp, &resp_index, "busy_poll_hits",
+              __atomic_load_n(&stats->busy_poll_hits, __ATOMIC_RELAXED));
+  encode_stat(resp, &resp_index, "notifications", stats->notifications);
+  encode_stat(resp, &resp_index, "coalesce_timeouts", stats->coalesce_timeouts);
+
+  //{:notify_batch_hist, [{upper_bound, count}, ...]}
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "notify_batch_hist");
+  ei_encode_list_header(resp, &resp_index, NUM_BATCH_BUCKETS);
+  for (int i = 0; i < NUM_BATCH_BUCKETS; i++) {
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_long(resp, &resp_index, batch_bucket_bounds[i]);
+    ei_encode_ulonglong(resp, &resp_index, stats->batch_hist[i]);
   }
+  ei_encode_empty_list(resp, &resp_index);
+
+  ei_encode_empty_list(resp, &resp_index);
+  erlcmd_send(resp, resp_index);
 }
 
 static void handle_open(const char *req, int *req_index)
@@ -144,8 +618,13 @@ static void handle_open(const char *req, int *req_index)
   //REVIEW: is this necessary?
   interface_name[binary_len] = '\0';
 
-  if (can_is_open(can_port))
+  if (can_is_open(can_port)) {
+    //frames buffered from the old interface are still delivered
+    send_notification();
     can_close(can_port);
+  }
+  if (j1939_is_open(j1939_port))
+    j1939_close(j1939_port);
 
   if (can_open(can_port, interface_name, &rcvbuf_size, &sndbuf_size) >= 0) {
     send_ok_response();
@@ -154,35 +633,339 @@ static void handle_open(const char *req, int *req_index)
   }
 }
 
+//request is :off or {refresh_ms, [{can_id, <<mask::8 bytes>>}]}
+static void handle_change_filter(const char *req, int *req_index)
+{
+  struct rx_filter *filter = &can_port->rx_filter;
+  char atom[MAXATOMLEN];
+  int atom_index = *req_index;
+  if (ei_decode_atom(req, &atom_index, atom) == 0 && strcmp(atom, "off") == 0) {
+    rx_filter_set_change_detect(filter, false, 0);
+    rx_filter_clear(filter);
+    send_ok_response();
+    return;
+  }
+
+  int arity;
+  if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 2)
+    errx(EXIT_FAILURE, "expecting {refresh_ms, masks}");
+  unsigned long refresh_ms;
+  if (ei_decode_ulong(req, req_index, &refresh_ms) < 0)
+    errx(EXIT_FAILURE, "bad refresh_ms");
+  int num_masks;
+  if (ei_decode_list_header(req, req_index, &num_masks) < 0)
+    errx(EXIT_FAILURE, "expecting a list of masks");
+  if (num_masks > RX_FILTER_MAX_MASKS) {
+    send_error_notification("too many change filter masks");
+    return;
+  }
+
+  //decode everything before touching the filter, so a bad request leaves it as it was
+  canid_t ids[RX_FILTER_MAX_MASKS];
+  uint8_t masks[RX_FILTER_MAX_MASKS][8];
+  for (int i = 0; i < num_masks; i++) {
+    unsigned long id;
+    int type, size;
+    long mask_len;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 2 ||
+        ei_decode_ulong(req, req_index, &id) < 0 ||
+        ei_get_type(req, req_index, &type, &size) < 0 || type != ERL_BINARY_EXT || size != 8 ||
+        ei_decode_binary(req, req_index, masks[i], &mask_len) < 0)
+      errx(EXIT_FAILURE, "expecting {can_id, <<mask::8 bytes>>}");
+    ids[i] = id;
+  }
+
+  //masks replace the previous configuration
+  rx_filter_clear(filter);
+  for (int i = 0; i < num_masks; i++) {
+    if (rx_filter_set_mask(filter, ids[i], masks[i]) < 0) {
+      //colliding ids filled a probe run; leave change detection off rather than half set up
+      rx_filter_set_change_detect(filter, false, 0);
+      rx_filter_clear(filter);
+      send_error_notification("too many change filter masks");
+      return;
+    }
+  }
+  rx_filter_set_change_detect(filter, true, refresh_ms);
+  send_ok_response();
+}
+
+//request is a list of {id, mask, :every | :window, n_or_ms}
+static void handle_decimate(const char *req, int *req_index)
+{
+  int num_rules;
+  if (ei_decode_list_header(req, req_index, &num_rules) < 0)
+    errx(EXIT_FAILURE, "expecting a list of rules");
+  if (num_rules > RX_FILTER_MAX_RULES) {
+    send_error_notification("too many decimation rules");
+    return;
+  }
+
+  struct decimate_rule rules[RX_FILTER_MAX_RULES];
+  for (int i = 0; i < num_rules; i++) {
+    int arity;
+    unsigned long id, mask, param;
+    char mode[MAXATOMLEN];
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 || arity != 4 ||
+        ei_decode_ulong(req, req_index, &id) < 0 ||
+        ei_decode_ulong(req, req_index, &mask) < 0 ||
+        ei_decode_atom(req, req_index, mode) < 0 ||
+        ei_decode_ulong(req, req_index, &param) < 0 || param == 0)
+      errx(EXIT_FAILURE, "expecting {id, mask, mode, param}");
+
+    rules[i].id = id;
+    rules[i].mask = mask;
+    rules[i].param = param;
+    if (strcmp(mode, "every") == 0)
+      rules[i].mode = DECIMATE_EVERY;
+    else if (strcmp(mode, "window") == 0)
+      rules[i].mode = DECIMATE_WINDOW;
+    else
+      errx(EXIT_FAILURE, "unknown decimation mode: %s", mode);
+  }
+
+  rx_filter_set_rules(&can_port->rx_filter, rules, num_rules);
+  send_ok_response();
+}
+
+/**
+ * @brief Send {:tx_confirm, [{tag, index, timestamp_ns}]} for the echoes
+ * collected by the last read
+ */
+static void notify_tx_confirmations()
+{
+  //tag + index + timestamp, each at most a 4 or 8 byte bignum, plus headers
+  char *resp = malloc(36 + (MAX_NOTIFY_FRAMES * 32));
+  int resp_index = sizeof(uint16_t);
+  resp[resp_index++] = notification_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_tuple_header(resp, &resp_index, 2);
+  ei_encode_atom(resp, &resp_index, "tx_confirm");
+  ei_encode_list_header(resp, &resp_index, can_port->num_confirmations);
+  for (int i = 0; i < can_port->num_confirmations; i++) {
+    struct tx_confirmation *confirmation = &can_port->confirmations[i];
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_ulong(resp, &resp_index, confirmation->tag);
+    ei_encode_ulong(resp, &resp_index, confirmation->index);
+    ei_encode_ulonglong(resp, &resp_index, confirmation->timestamp);
+  }
+  ei_encode_empty_list(resp, &resp_index);
+  erlcmd_send(resp, resp_index);
+  free(resp);
+  can_port->num_confirmations = 0;
+}
+
+static void fail_read()
+{
+  char *err_str[64];
+  sprintf(err_str, "read() error: %d", errno);
+  send_error_notification(err_str);
+  errx(EXIT_FAILURE, err_str);
+}
+
 static void notify_read()
 {
-  //each can frame is ENCODED_READ_FRAME_SIZE, add 32 (not exactly calculated) for headers + other stuff
-  can_port->read_buffer = malloc(36 + (1000 * ENCODED_READ_FRAME_SIZE));
+  int num_read = can_read_into_buffer(can_port, &can_port->batch_index, start_notification());
+  if (num_read < 0)
+    fail_read();
+  finish_notification(num_read);
+
+  if (can_port->num_confirmations > 0)
+    notify_tx_confirmations();
+}
+
+/**
+ * @brief Threaded mode: send what the reader thread has queued, a
+ * notification per MAX_NOTIFY_FRAMES
+ */
+static void notify_ring()
+{
+  uint64_t count;
+  if (read(can_port->reader_notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    err(EXIT_FAILURE, "reader_notify_fd");
+
+  //stop after roughly one ring's worth so stdin isn't starved by a busy bus
+  int max_notifications = can_port->rx_ring.size / MAX_NOTIFY_FRAMES + 1;
+  for (int i = 0; i < max_notifications && !rx_ring_empty(&can_port->rx_ring); i++) {
+    int num_read = can_read_ring_into_buffer(can_port, &can_port->batch_index, start_notification());
+    if (num_read < 0)
+      fail_read();
+    finish_notification(num_read);
+
+    if (can_port->num_confirmations > 0)
+      notify_tx_confirmations();
+  }
+
+  //the reader thread may have stopped on an error without queueing anything
+  int reader_error = can_reader_error(can_port);
+  if (reader_error != 0) {
+    errno = reader_error;
+    fail_read();
+  }
+
+  //come straight back if there's more
+  if (!rx_ring_empty(&can_port->rx_ring)) {
+    uint64_t one = 1;
+    if (write(can_port->reader_notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      err(EXIT_FAILURE, "reader_notify_fd");
+  }
+}
+
+static void notify_held_frames()
+{
+  if (rx_filter_next_deadline(&can_port->rx_filter) != 0)
+    return;
+
+  //released frames can fill a notification on their own, so send what's
+  //buffered first. They've already waited out their window, so they go
+  //out right away.
+  send_notification();
+  start_notification();
+  can_port->batch_frames = can_flush_held_frames(can_port, &can_port->batch_index);
+  send_notification();
+}
+
+/**
+ * @brief Send {:j1939, messages, num_messages} with the messages waiting
+ * on the J1939 socket
+ */
+static void notify_j1939()
+{
+  char *resp = j1939_port->read_buffer;
   int resp_index = sizeof(uint16_t);
-  can_port->read_buffer[resp_index++] = notification_id;
-  ei_encode_version(can_port->read_buffer, &resp_index);
-  ei_encode_tuple_header(can_port->read_buffer, &resp_index, 3);
-  ei_encode_atom(can_port->read_buffer, &resp_index, "notif");
-  int num_read = can_read_into_buffer(can_port, &resp_index);
-  if (num_read < 0){
-    char *err_str[64];
-    sprintf(err_str, "read() error: %d", errno);
-    send_error_notification(err_str);
-    errx(EXIT_FAILURE, err_str);
-  }
-  ei_encode_empty_list(can_port->read_buffer, &resp_index);
-  ei_encode_ulong(can_port->read_buffer, &resp_index, num_read);
-  erlcmd_send(can_port->read_buffer, resp_index);
-  free(can_port->read_buffer);
-  can_port->read_buffer = NULL;
+  resp[resp_index++] = notification_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_tuple_header(resp, &resp_index, 3);
+  ei_encode_atom(resp, &resp_index, "j1939");
+
+  int num_read = j1939_read_into_buffer(j1939_port, &resp_index);
+  if (num_read < 0)
+    fail_read();
+  if (num_read > 0) {
+    can_record_batch(can_port, num_read);
+    ei_encode_empty_list(resp, &resp_index);
+    ei_encode_ulong(resp, &resp_index, num_read);
+    erlcmd_send(resp, resp_index);
+  }
+  //an error held back behind the messages just sent comes out on the next read
+  if (j1939_port->read_error != 0 && j1939_read_into_buffer(j1939_port, &resp_index) < 0)
+    fail_read();
+}
+
+//:manual, :error_frame, {:id, can_id} or {:payload, can_id}
+static void encode_recording_reason(char *resp, int *resp_index, struct flight_recorder *recorder)
+{
+  switch (recorder->reason) {
+  case TRIGGER_MANUAL:
+    ei_encode_atom(resp, resp_index, "manual");
+    break;
+  case TRIGGER_ERROR_FRAME:
+    ei_encode_atom(resp, resp_index, "error_frame");
+    break;
+  default:
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, recorder->reason == TRIGGER_ID ? "id" : "payload");
+    ei_encode_ulong(resp, resp_index, recorder->reason_id);
+    break;
+  }
+}
+
+static int start_recording_message(char *resp, const char *tag, struct flight_recorder *recorder)
+{
+  int resp_index = sizeof(uint16_t);
+  resp[resp_index++] = notification_id;
+  ei_encode_version(resp, &resp_index);
+  ei_encode_tuple_header(resp, &resp_index, 5);
+  ei_encode_atom(resp, &resp_index, tag);
+  encode_recording_reason(resp, &resp_index, recorder);
+  ei_encode_ulonglong(resp, &resp_index, recorder->triggered_at);
+  return resp_index;
+}
+
+/**
+ * @brief The post-trigger window has ended: append the recording to the
+ * dump file and send {:recording_saved, reason, triggered_at, num_frames},
+ * or send it as {:recording, reason, triggered_at, frames, more} chunks
+ */
+static void notify_recording()
+{
+  struct flight_recorder *recorder = &can_port->recorder;
+  char *resp = can_port->recording_buffer;
+
+  if (recorder->path != NULL) {
+    int num_saved = recorder_save(recorder, can_port->interface_name);
+    if (num_saved < 0) {
+      send_error_notification("can't write flight recorder dump");
+    } else {
+      int resp_index = start_recording_message(resp, "recording_saved", recorder);
+      ei_encode_ulong(resp, &resp_index, num_saved);
+      erlcmd_send(resp, resp_index);
+    }
+  } else {
+    uint32_t i = recorder_window_start(recorder);
+    do {
+      int resp_index = start_recording_message(resp, "recording", recorder);
+      for (int n = 0; n < RECORDER_CHUNK_FRAMES && i < recorder->count; n++, i++) {
+        struct recorded_frame *recorded = recorder_frame(recorder, i);
+        int dlc = recorded->can_frame.can_dlc > 8 ? 8 : recorded->can_frame.can_dlc;
+        ei_encode_list_header(resp, &resp_index, 1);
+        ei_encode_tuple_header(resp, &resp_index, 3);
+        ei_encode_ulonglong(resp, &resp_index, recorded->timestamp);
+        ei_encode_ulong(resp, &resp_index, recorded->can_frame.can_id);
+        ei_encode_binary(resp, &resp_index, recorded->can_frame.data, dlc);
+      }
+      ei_encode_empty_list(resp, &resp_index);
+      ei_encode_boolean(resp, &resp_index, i < recorder->count);
+      erlcmd_send(resp, resp_index);
+    } while (i < recorder->count);
+  }
+
+  recorder_rearm(recorder);
+}
+
+static void notify_coalesce_timeout()
+{
+  //a notification sent since poll() returned disarms the timer
+  uint64_t expirations;
+  if (read(can_port->coalesce_timer_fd, &expirations, sizeof(expirations)) < 0) {
+    if (errno == EAGAIN)
+      return;
+    err(EXIT_FAILURE, "coalesce_timer_fd");
+  }
+  can_port->stats.coalesce_timeouts++;
+  send_notification();
 }
 
 static struct request_handler request_handlers[] = {
   { "write", handle_write },
   { "open", handle_open },
+  { "stats", handle_stats },
+  { "change_filter", handle_change_filter },
+  { "decimate", handle_decimate },
+  { "tx_queues", handle_tx_queues },
+  { "tx_confirm", handle_tx_confirm },
+  { "threaded", handle_threaded },
+  { "coalesce", handle_coalesce },
+  { "j1939_open", handle_j1939_open },
+  { "j1939_write", handle_j1939_write },
+  { "recorder", handle_recorder },
+  { "record_trigger", handle_record_trigger },
+  { "realtime", handle_realtime },
   { NULL, NULL }
 };
 
+//poll until the next held frame or recording is due
+static int next_timeout()
+{
+  int filter_timeout = rx_filter_next_deadline(&can_port->rx_filter);
+  int recorder_timeout = recorder_next_deadline(&can_port->recorder);
+  if (filter_timeout < 0)
+    return recorder_timeout;
+  if (recorder_timeout < 0)
+    return filter_timeout;
+  return filter_timeout < recorder_timeout ? filter_timeout : recorder_timeout;
+}
+
 static void handle_elixir_request(const char *req, void *cookie)
 {
   (void) cookie;
@@ -223,27 +1006,65 @@ int main(int argc, char *argv[])
 #endif
   if (can_init(&can_port) < 0)
     errx(EXIT_FAILURE, "can_init failed");
+  if (j1939_init(&j1939_port) < 0)
+    errx(EXIT_FAILURE, "j1939_init failed");
 
   struct erlcmd *handler = malloc(sizeof(struct erlcmd));
   erlcmd_init(handler, handle_elixir_request, NULL);
 
   for (;;) {
-    struct pollfd fdset[3];
+    struct pollfd fdset[5];
     int num_listeners = 2;
+    int ring_index = -1;
+    int timer_index = -1;
+    int j1939_index = -1;
 
     fdset[0].fd = STDIN_FILENO;
     fdset[0].events = POLLIN;
     fdset[0].revents = 0;
 
+    //in threaded mode the reader thread owns POLLIN on the socket
     fdset[1].fd = can_port->fd;
-    fdset[1].events = POLLIN;
+    fdset[1].events = can_port->threaded ? 0 : POLLIN;
     fdset[1].revents = 0;
 
-    if(can_port->write_buffer_size > 0) {
+    if(can_tx_pending(can_port)) {
       fdset[1].events |= POLLOUT;
     }
 
-    int rc = poll(fdset, num_listeners, -1);
+    if (can_port->threaded) {
+      ring_index = num_listeners++;
+      fdset[ring_index].fd = can_port->reader_notify_fd;
+      fdset[ring_index].events = POLLIN;
+      fdset[ring_index].revents = 0;
+    }
+
+    //a partial notification is waiting to be sent
+    if (can_port->coalesce_timer_armed) {
+      timer_index = num_listeners++;
+      fdset[timer_index].fd = can_port->coalesce_timer_fd;
+      fdset[timer_index].events = POLLIN;
+      fdset[timer_index].revents = 0;
+    }
+
+    if (j1939_is_open(j1939_port)) {
+      j1939_index = num_listeners++;
+      fdset[j1939_index].fd = j1939_port->fd;
+      fdset[j1939_index].events = POLLIN;
+      fdset[j1939_index].revents = 0;
+    }
+
+    //wake up in time to release frames held by decimation windows, or
+    //to dump a recording once its post-trigger window is over
+    int timeout = next_timeout();
+
+    bool spun;
+    //in threaded mode the reader thread spins on the socket; spinning here
+    //too would only burn a second CPU waiting on its eventfd
+    int busy_poll_us = can_port->threaded ? 0 : can_port->realtime.busy_poll_us;
+    int rc = busy_poll(fdset, num_listeners, timeout, busy_poll_us, &spun);
+    if (spun)
+      __atomic_add_fetch(&can_port->stats.busy_poll_hits, 1, __ATOMIC_RELAXED);
     if (rc < 0) {
       // Retry if EINTR
       if (errno == EINTR)
@@ -251,19 +1072,42 @@ int main(int argc, char *argv[])
 
       errx(EXIT_FAILURE, "poll");
     }
+    can_port->stats.poll_wakeups++;
 
     if (fdset[0].revents & (POLLIN | POLLHUP)) {
       if (erlcmd_process(handler))
         break;
     }
-    //ready to work through write buffer
+    //ready to work through the tx queues
     if (fdset[1].revents & POLLOUT) {
-      process_write_buffer();
+      process_tx_queues();
     }
 
-    if (fdset[1].revents & POLLIN) {
+    //a command may have just switched modes, so check again
+    if ((fdset[1].revents & POLLIN) && !can_port->threaded) {
       notify_read();
     }
+
+    if (ring_index >= 0 && can_port->threaded && (fdset[ring_index].revents & POLLIN)) {
+      notify_ring();
+    }
+
+    if (j1939_index >= 0 && j1939_is_open(j1939_port) && (fdset[j1939_index].revents & POLLIN)) {
+      notify_j1939();
+    }
+
+    //after reading, so frames that just arrived go out with the rest
+    if (timer_index >= 0 && (fdset[timer_index].revents & POLLIN)) {
+      notify_coalesce_timeout();
+    }
+
+    if (can_port->rx_filter.num_pending > 0) {
+      notify_held_frames();
+    }
+
+    if (recorder_due(&can_port->recorder)) {
+      notify_recording();
+    }
   }
 
   return 0;
@@ -0,0 +1,118 @@
+#include "realtime.h"
+#include "util.h"
+
+#include <malloc.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static void prefault_stack()
+{
+  volatile char stack[PREFAULT_STACK_SIZE];
+  memset((char *) stack, 0, sizeof(stack));
+}
+
+static uint64_t monotonic_us()
+{
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return ((uint64_t) tp.tv_sec) * 1000000 + tp.tv_nsec / 1000;
+}
+
+static void set_cpus(cpu_set_t *cpus, int cpu)
+{
+  CPU_ZERO(cpus);
+  if (cpu != REALTIME_ANY_CPU) {
+    CPU_SET(cpu, cpus);
+    return;
+  }
+  long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  for (long i = 0; i < num_cpus && i < CPU_SETSIZE; i++)
+    CPU_SET(i, cpus);
+}
+
+/**
+ * @brief Apply scheduling and CPU affinity to one thread, leaving alone
+ * whichever is REALTIME_UNCHANGED. Threads created afterwards inherit both.
+ *
+ * @return 0, or the realtime_failure bits for what couldn't be applied
+ */
+int realtime_apply_thread(pthread_t thread, struct realtime_config *config)
+{
+  int failed = 0;
+
+  if (config->priority != REALTIME_UNCHANGED) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config->priority;
+    int policy = config->priority > 0 ? SCHED_FIFO : SCHED_OTHER;
+    if (pthread_setschedparam(thread, policy, &param) != 0)
+      failed |= REALTIME_FAILED_PRIORITY;
+  }
+
+  if (config->cpu != REALTIME_UNCHANGED) {
+    cpu_set_t cpus;
+    set_cpus(&cpus, config->cpu);
+    if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+      failed |= REALTIME_FAILED_CPU;
+  }
+
+  return failed;
+}
+
+/**
+ * @brief Apply config to the calling (main) thread and lock or unlock
+ * the process's memory. Whatever can be applied is, even if other parts fail.
+ *
+ * @return 0, or the realtime_failure bits for what couldn't be applied
+ */
+int realtime_apply_process(struct realtime_config *config)
+{
+  int failed = realtime_apply_thread(pthread_self(), config);
+
+  if (config->lock_memory == 1) {
+    //keep freed memory around instead of handing it back to be faulted in again
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+      failed |= REALTIME_FAILED_LOCK_MEMORY;
+    else
+      prefault_stack();
+  } else if (config->lock_memory == 0) {
+    munlockall();
+  }
+  return failed;
+}
+
+/**
+ * @brief poll(), but first check without sleeping for up to busy_poll_us,
+ * trading a spinning CPU for not paying the wakeup latency
+ *
+ * @param spun set if the spin found something
+ */
+int busy_poll(struct pollfd *fds, nfds_t nfds, int timeout, int busy_poll_us, bool *spun)
+{
+  *spun = false;
+  if (busy_poll_us <= 0 || timeout == 0)
+    return poll(fds, nfds, timeout);
+
+  uint64_t start = monotonic_us();
+  uint64_t spin_us = (uint64_t) busy_poll_us;
+  if (timeout > 0 && (uint64_t) timeout * 1000 < spin_us)
+    spin_us = (uint64_t) timeout * 1000;
+  uint64_t elapsed;
+  do {
+    int rc = poll(fds, nfds, 0);
+    if (rc != 0) {
+      *spun = rc > 0;
+      return rc;
+    }
+    elapsed = monotonic_us() - start;
+  } while (elapsed < spin_us);
+
+  if (timeout > 0)
+    timeout = elapsed / 1000 >= (uint64_t) timeout ? 0 : timeout - (int) (elapsed / 1000);
+  return poll(fds, nfds, timeout);
+}
@@ -0,0 +1,41 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+
+//stack touched after mlockall so the main loop doesn't fault it in later
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+//a realtime_config field set to this is left as it is
+#define REALTIME_UNCHANGED -1
+//cpu that undoes pinning
+#define REALTIME_ANY_CPU -2
+
+struct realtime_config {
+    //SCHED_FIFO priority, 0 for the normal scheduler
+    int priority;
+    //CPU to pin to, or REALTIME_ANY_CPU
+    int cpu;
+    //1 to lock memory, 0 to unlock it
+    int lock_memory;
+    //spin on poll() for this long before sleeping in it, 0 to never
+    int busy_poll_us;
+};
+
+//the parts of a realtime_config that couldn't be applied, usually for lack of privileges
+enum realtime_failure {
+    REALTIME_FAILED_PRIORITY = 1 << 0,
+    REALTIME_FAILED_CPU = 1 << 1,
+    REALTIME_FAILED_LOCK_MEMORY = 1 << 2
+};
+
+int realtime_apply_process(struct realtime_config *config);
+
+int realtime_apply_thread(pthread_t thread, struct realtime_config *config);
+
+int busy_poll(struct pollfd *fds, nfds_t nfds, int timeout, int busy_poll_us, bool *spun);
+
+#endif // REALTIME_H
@@ -0,0 +1,276 @@
+#include "rx_filter.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int slot_for(canid_t can_id)
+{
+  //fibonacci hashing spreads sequential ids across the table
+  return (can_id * 2654435761u) & (RX_FILTER_SLOTS - 1);
+}
+
+/**
+ * @return the entry for can_id, creating it if create is set. NULL if
+ * the id isn't tracked or there's no free slot within RX_FILTER_MAX_PROBES.
+ * Entries are never removed, so a tracked id is always found within that
+ * many probes too.
+ */
+static struct rx_filter_entry *lookup(struct rx_filter *filter, canid_t can_id, bool create)
+{
+  unsigned int slot = slot_for(can_id);
+  for (int probe = 0; probe < RX_FILTER_MAX_PROBES; probe++) {
+    struct rx_filter_entry *entry = &filter->entries[slot];
+    if (!entry->used) {
+      if (!create)
+        return NULL;
+      memset(entry, 0, sizeof(*entry));
+      entry->used = true;
+      entry->can_id = can_id;
+      memset(entry->mask, 0xff, sizeof(entry->mask));
+      //force a rule match on first use
+      entry->rule_generation = filter->rule_generation - 1;
+      filter->used_slots[filter->num_entries++] = slot;
+      return entry;
+    }
+    if (entry->can_id == can_id)
+      return entry;
+    slot = (slot + 1) & (RX_FILTER_SLOTS - 1);
+  }
+  return NULL;
+}
+
+void rx_filter_init(struct rx_filter *filter)
+{
+  filter->change_detect = false;
+  filter->refresh_ms = 0;
+  filter->num_rules = 0;
+  filter->rule_generation = 0;
+  filter->num_pending = 0;
+  filter->entries = calloc(RX_FILTER_SLOTS, sizeof(struct rx_filter_entry));
+  filter->used_slots = calloc(RX_FILTER_SLOTS, sizeof(int));
+  if (filter->entries == NULL || filter->used_slots == NULL)
+    errx(EXIT_FAILURE, "rx_filter_init: out of memory");
+  filter->num_entries = 0;
+  filter->table_full = 0;
+}
+
+/**
+ * @brief Forget all per-id state, including masks and held frames.
+ * Decimation rules are kept.
+ */
+void rx_filter_clear(struct rx_filter *filter)
+{
+  memset(filter->entries, 0, RX_FILTER_SLOTS * sizeof(struct rx_filter_entry));
+  filter->num_entries = 0;
+  filter->num_pending = 0;
+  filter->table_full = 0;
+}
+
+void rx_filter_set_change_detect(struct rx_filter *filter, bool enabled, uint64_t refresh_ms)
+{
+  filter->change_detect = enabled;
+  filter->refresh_ms = refresh_ms;
+}
+
+/**
+ * @brief Only compare the bits set in mask when checking can_id for changes
+ *
+ * @return 0 on success, -1 if the table is full
+ */
+int rx_filter_set_mask(struct rx_filter *filter, canid_t can_id, const uint8_t *mask)
+{
+  struct rx_filter_entry *entry = lookup(filter, can_id, true);
+  if (entry == NULL)
+    return -1;
+  memcpy(entry->mask, mask, sizeof(entry->mask));
+  entry->forwarded = false;
+  return 0;
+}
+
+/**
+ * @brief Replace the decimation rules. The first matching rule applies.
+ * Frames already held keep their deadline.
+ *
+ * @return 0 on success, -1 if there are too many rules
+ */
+int rx_filter_set_rules(struct rx_filter *filter, const struct decimate_rule *rules, int num_rules)
+{
+  if (num_rules > RX_FILTER_MAX_RULES)
+    return -1;
+  memcpy(filter->rules, rules, num_rules * sizeof(struct decimate_rule));
+  filter->num_rules = num_rules;
+  filter->rule_generation++;
+  return 0;
+}
+
+/**
+ * @return true if any filtering is configured, so callers can skip
+ * rx_filter_accept (and reading the clock) entirely when it isn't
+ */
+bool rx_filter_active(struct rx_filter *filter)
+{
+  return filter->change_detect || filter->num_rules > 0 || filter->num_pending > 0;
+}
+
+static enum rx_filter_result check_change(struct rx_filter *filter,
+                                          struct rx_filter_entry *entry,
+                                          struct can_frame *can_frame,
+                                          uint64_t now)
+{
+  if (!filter->change_detect)
+    return RX_FILTER_FORWARD;
+
+  uint8_t masked[8];
+  for (int i = 0; i < 8; i++)
+    masked[i] = can_frame->data[i] & entry->mask[i];
+
+  bool unchanged = entry->forwarded &&
+                   entry->dlc == can_frame->can_dlc &&
+                   memcmp(entry->data, masked, sizeof(masked)) == 0;
+  bool refresh_due = filter->refresh_ms > 0 &&
+                     now - entry->last_forwarded >= filter->refresh_ms;
+  if (unchanged && !refresh_due)
+    return RX_FILTER_UNCHANGED;
+
+  entry->forwarded = true;
+  entry->dlc = can_frame->can_dlc;
+  memcpy(entry->data, masked, sizeof(masked));
+  entry->last_forwarded = now;
+  return RX_FILTER_FORWARD;
+}
+
+/**
+ * @return the index of the first rule matching can_id, or -1
+ */
+static int match_rule(struct rx_filter *filter, canid_t can_id)
+{
+  for (int i = 0; i < filter->num_rules; i++) {
+    struct decimate_rule *rule = &filter->rules[i];
+    if ((can_id & rule->mask) == (rule->id & rule->mask))
+      return i;
+  }
+  return -1;
+}
+
+static struct decimate_rule *rule_for(struct rx_filter *filter, struct rx_filter_entry *entry)
+{
+  if (entry->rule_generation != filter->rule_generation) {
+    entry->rule_generation = filter->rule_generation;
+    entry->rule = match_rule(filter, entry->can_id);
+    entry->count = 0;
+  }
+  return entry->rule >= 0 ? &filter->rules[entry->rule] : NULL;
+}
+
+static enum rx_filter_result decimate(struct rx_filter *filter,
+                                      struct rx_filter_entry *entry,
+                                      struct can_frame *can_frame,
+                                      uint64_t now)
+{
+  struct decimate_rule *rule = rule_for(filter, entry);
+  if (rule == NULL)
+    return RX_FILTER_FORWARD;
+
+  if (rule->mode == DECIMATE_EVERY) {
+    //forwards the 1st, (n+1)th, ... frame
+    uint32_t count = entry->count++;
+    if (entry->count >= rule->param)
+      entry->count = 0;
+    return count == 0 ? RX_FILTER_FORWARD : RX_FILTER_DECIMATED;
+  }
+
+  if (!entry->pending && (entry->window_start == 0 || now - entry->window_start >= rule->param)) {
+    entry->window_start = now;
+    return RX_FILTER_FORWARD;
+  }
+
+  //latest wins: the held frame is replaced
+  bool replaced = entry->pending;
+  if (!entry->pending) {
+    entry->pending = true;
+    filter->num_pending++;
+  }
+  entry->pending_frame = *can_frame;
+  return replaced ? RX_FILTER_DECIMATED : RX_FILTER_HELD;
+}
+
+/**
+ * @brief Decide whether a received frame should be forwarded to Elixir
+ *
+ * @param now current_time() in ms
+ */
+enum rx_filter_result rx_filter_accept(struct rx_filter *filter, struct can_frame *can_frame, uint64_t now)
+{
+  //error frames are never filtered
+  if (can_frame->can_id & CAN_ERR_FLAG)
+    return RX_FILTER_FORWARD;
+
+  struct rx_filter_entry *entry = lookup(filter, can_frame->can_id, false);
+  if (entry == NULL) {
+    //only ids that something applies to get an entry, so the table
+    //doesn't fill up with ids that are simply passed through
+    if (!filter->change_detect && match_rule(filter, can_frame->can_id) < 0)
+      return RX_FILTER_FORWARD;
+    entry = lookup(filter, can_frame->can_id, true);
+    if (entry == NULL) {
+      filter->table_full++;
+      return RX_FILTER_FORWARD;
+    }
+  }
+
+  enum rx_filter_result result = decimate(filter, entry, can_frame, now);
+  if (result != RX_FILTER_FORWARD)
+    return result;
+
+  return check_change(filter, entry, can_frame, now);
+}
+
+static uint64_t pending_deadline(struct rx_filter *filter, struct rx_filter_entry *entry)
+{
+  //a rule change may have removed the window; flush right away then
+  struct decimate_rule *rule = rule_for(filter, entry);
+  if (rule == NULL || rule->mode != DECIMATE_WINDOW)
+    return 0;
+  return entry->window_start + rule->param;
+}
+
+/**
+ * @return ms until the next held frame is due, or -1 if nothing is held
+ */
+int rx_filter_next_deadline(struct rx_filter *filter)
+{
+  if (filter->num_pending == 0)
+    return -1;
+
+  uint64_t now = current_time();
+  uint64_t next = UINT64_MAX;
+  for (int i = 0; i < filter->num_entries; i++) {
+    struct rx_filter_entry *entry = &filter->entries[filter->used_slots[i]];
+    if (entry->pending) {
+      uint64_t deadline = pending_deadline(filter, entry);
+      if (deadline < next)
+        next = deadline;
+    }
+  }
+  return next <= now ? 0 : (int) (next - now);
+}
+
+/**
+ * @brief Release held frames whose window has ended. emit is called for
+ * each one with RX_FILTER_FORWARD, or RX_FILTER_UNCHANGED if change
+ * detection suppressed it.
+ */
+void rx_filter_flush(struct rx_filter *filter, uint64_t now, rx_filter_emit_fn emit, void *cookie)
+{
+  for (int i = 0; i < filter->num_entries && filter->num_pending > 0; i++) {
+    struct rx_filter_entry *entry = &filter->entries[filter->used_slots[i]];
+    if (!entry->pending || pending_deadline(filter, entry) > now)
+      continue;
+
+    entry->pending = false;
+    filter->num_pending--;
+    entry->window_start = now;
+    emit(cookie, &entry->pending_frame, check_change(filter, entry, &entry->pending_frame, now));
+  }
+}
@@ -0,0 +1,107 @@
+#ifndef RX_FILTER_H
+#define RX_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+//open addressed, so keep it well above the number of ids on a bus
+#define RX_FILTER_SLOTS 2048
+//ids that can't find a free slot this close to home go untracked
+#define RX_FILTER_MAX_PROBES 32
+#define RX_FILTER_MAX_RULES 64
+//on_change masks per request, well below RX_FILTER_SLOTS
+#define RX_FILTER_MAX_MASKS 256
+
+enum rx_filter_result {
+    RX_FILTER_FORWARD,
+    //same (masked) payload as the last frame forwarded
+    RX_FILTER_UNCHANGED,
+    //dropped by a decimation rule
+    RX_FILTER_DECIMATED,
+    //kept back until its decimation window ends
+    RX_FILTER_HELD
+};
+
+enum decimate_mode {
+    //forward every nth frame
+    DECIMATE_EVERY,
+    //forward at most one frame per window, the latest one wins
+    DECIMATE_WINDOW
+};
+
+//applies to every id where (can_id & mask) == (id & mask)
+struct decimate_rule {
+    canid_t id;
+    canid_t mask;
+    enum decimate_mode mode;
+    //n for DECIMATE_EVERY, window in ms for DECIMATE_WINDOW
+    uint32_t param;
+};
+
+//per-id state, looked up by can_id
+struct rx_filter_entry {
+    canid_t can_id;
+    bool used;
+
+    //change detection
+    bool forwarded;
+    uint8_t dlc;
+    //last forwarded payload, already masked
+    uint8_t data[8];
+    //payload bits that count as a change
+    uint8_t mask[8];
+    uint64_t last_forwarded;
+
+    //decimation; rule is only valid while rule_generation matches the filter's
+    uint32_t rule_generation;
+    int rule;
+    uint32_t count;
+    uint64_t window_start;
+    bool pending;
+    struct can_frame pending_frame;
+};
+
+struct rx_filter {
+    //suppress frames whose (masked) payload matches the last one forwarded
+    bool change_detect;
+    //forward an unchanged frame anyway after this many ms, 0 to never
+    uint64_t refresh_ms;
+
+    struct decimate_rule rules[RX_FILTER_MAX_RULES];
+    int num_rules;
+    //bumped whenever rules change so entries re-match lazily
+    uint32_t rule_generation;
+    int num_pending;
+
+    struct rx_filter_entry *entries;
+    //slots in use, so flushing doesn't walk the whole table
+    int *used_slots;
+    int num_entries;
+    //frames that needed an entry but went unfiltered because none was free
+    uint64_t table_full;
+};
+
+typedef void (*rx_filter_emit_fn)(void *cookie, struct can_frame *can_frame,
+                                  enum rx_filter_result result);
+
+void rx_filter_init(struct rx_filter *filter);
+
+void rx_filter_clear(struct rx_filter *filter);
+
+void rx_filter_set_change_detect(struct rx_filter *filter, bool enabled, uint64_t refresh_ms);
+
+int rx_filter_set_mask(struct rx_filter *filter, canid_t can_id, const uint8_t *mask);
+
+int rx_filter_set_rules(struct rx_filter *filter, const struct decimate_rule *rules, int num_rules);
+
+bool rx_filter_active(struct rx_filter *filter);
+
+enum rx_filter_result rx_filter_accept(struct rx_filter *filter, struct can_frame *can_frame, uint64_t now);
+
+int rx_filter_next_deadline(struct rx_filter *filter);
+
+void rx_filter_flush(struct rx_filter *filter, uint64_t now, rx_filter_emit_fn emit, void *cookie);
+
+#endif // RX_FILTER_H
@@ -0,0 +1,71 @@
+#include "rx_ring.h"
+
+#include <stdlib.h>
+
+/**
+ * @param size rounded up to a power of two, at most RX_RING_MAX_SIZE
+ * @return 0 on success, -1 if size is too big or out of memory
+ */
+int rx_ring_init(struct rx_ring *ring, uint32_t size)
+{
+  if (size > RX_RING_MAX_SIZE)
+    return -1;
+
+  uint32_t rounded = 1;
+  while (rounded < size)
+    rounded <<= 1;
+
+  ring->frames = malloc(rounded * sizeof(struct rx_frame));
+  if (ring->frames == NULL)
+    return -1;
+  ring->size = rounded;
+  ring->head = 0;
+  ring->tail = 0;
+  return 0;
+}
+
+void rx_ring_free(struct rx_ring *ring)
+{
+  free(ring->frames);
+  ring->frames = NULL;
+  ring->size = 0;
+}
+
+/**
+ * @brief Called by the producer only
+ *
+ * @return false if the ring is full
+ */
+bool rx_ring_push(struct rx_ring *ring, const struct rx_frame *rx_frame)
+{
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (tail - head == ring->size)
+    return false;
+
+  ring->frames[tail & (ring->size - 1)] = *rx_frame;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @brief Called by the consumer only
+ *
+ * @return false if the ring is empty
+ */
+bool rx_ring_pop(struct rx_ring *ring, struct rx_frame *rx_frame)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return false;
+
+  *rx_frame = ring->frames[head & (ring->size - 1)];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool rx_ring_empty(struct rx_ring *ring)
+{
+  return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,49 @@
+#ifndef RX_RING_H
+#define RX_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+#define RX_RING_DEFAULT_SIZE 4096
+
+//ring sizes are rounded up to a power of two, so this is also the largest
+#define RX_RING_MAX_SIZE (1 << 20)
+
+//a frame as it came off the socket
+struct rx_frame {
+    struct can_frame can_frame;
+    //kernel's software receive time in ns since the epoch, 0 unless the
+    //socket timestamps frames
+    uint64_t rx_time;
+    //recvmsg flags, MSG_CONFIRM marks our own frames echoed back
+    int flags;
+};
+
+/*
+ * Single producer, single consumer ring of received frames. The reader
+ * thread only moves tail and the main thread only moves head, so neither
+ * side takes a lock.
+ */
+struct rx_ring {
+    struct rx_frame *frames;
+    //always a power of two
+    uint32_t size;
+
+    //keep the producer's and consumer's indices on separate cache lines
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+};
+
+int rx_ring_init(struct rx_ring *ring, uint32_t size);
+
+void rx_ring_free(struct rx_ring *ring);
+
+bool rx_ring_push(struct rx_ring *ring, const struct rx_frame *rx_frame);
+
+bool rx_ring_pop(struct rx_ring *ring, struct rx_frame *rx_frame);
+
+bool rx_ring_empty(struct rx_ring *ring);
+
+#endif // RX_RING_H
@@ -0,0 +1,76 @@
+#include "tx_queue.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void tx_queue_init(struct tx_queue *queue)
+{
+  queue->frames = NULL;
+  queue->depth = 0;
+  queue->head = 0;
+  queue->count = 0;
+  tx_queue_configure(queue, TX_DEFAULT_DEPTH, TX_POLICY_REJECT);
+}
+
+/**
+ * @brief Change the depth limit and full-queue policy. Queued frames are
+ * kept in order; if there are more than the new depth, the oldest go.
+ *
+ * @return the number of queued frames discarded
+ */
+int tx_queue_configure(struct tx_queue *queue, int depth, enum tx_policy policy)
+{
+  struct tx_frame *frames = malloc(depth * sizeof(struct tx_frame));
+  if (frames == NULL)
+    errx(EXIT_FAILURE, "tx_queue_configure: out of memory");
+
+  int discarded = queue->count > depth ? queue->count - depth : 0;
+  int kept = queue->count - discarded;
+  for (int i = 0; i < kept; i++)
+    frames[i] = queue->frames[(queue->head + discarded + i) % queue->depth];
+
+  free(queue->frames);
+  queue->frames = frames;
+  queue->depth = depth;
+  queue->head = 0;
+  queue->count = kept;
+  queue->policy = policy;
+  return discarded;
+}
+
+bool tx_queue_empty(struct tx_queue *queue)
+{
+  return queue->count == 0;
+}
+
+enum tx_push_result tx_queue_push(struct tx_queue *queue, struct tx_frame *tx_frame)
+{
+  enum tx_push_result result = TX_QUEUED;
+  if (queue->count == queue->depth) {
+    if (queue->policy == TX_POLICY_REJECT)
+      return TX_REJECTED;
+    tx_queue_pop(queue);
+    result = TX_QUEUED_DROPPED_OLDEST;
+  }
+  queue->frames[(queue->head + queue->count) % queue->depth] = *tx_frame;
+  queue->count++;
+  return result;
+}
+
+struct tx_frame *tx_queue_peek(struct tx_queue *queue)
+{
+  return queue->count > 0 ? &queue->frames[queue->head] : NULL;
+}
+
+void tx_queue_pop(struct tx_queue *queue)
+{
+  queue->head = (queue->head + 1) % queue->depth;
+  queue->count--;
+}
+
+void tx_queue_clear(struct tx_queue *queue)
+{
+  queue->head = 0;
+  queue->count = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef TX_QUEUE_H
+#define TX_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+//frames waiting for the socket to accept them, one ring per priority class
+#define TX_NUM_CLASSES 3
+#define TX_DEFAULT_DEPTH 1000
+
+enum tx_policy {
+    //refuse new frames while the queue is full
+    TX_POLICY_REJECT,
+    //make room by discarding the oldest queued frame
+    TX_POLICY_DROP_OLDEST
+};
+
+enum tx_push_result {
+    TX_QUEUED,
+    TX_REJECTED,
+    TX_QUEUED_DROPPED_OLDEST
+};
+
+struct tx_frame {
+    struct can_frame can_frame;
+    //write batch to confirm against, 0 if no confirmation was asked for
+    uint32_t tag;
+    //position within that batch
+    uint16_t index;
+};
+
+struct tx_queue {
+    struct tx_frame *frames;
+    int depth;
+    int head;
+    int count;
+    enum tx_policy policy;
+};
+
+void tx_queue_init(struct tx_queue *queue);
+
+int tx_queue_configure(struct tx_queue *queue, int depth, enum tx_policy policy);
+
+bool tx_queue_empty(struct tx_queue *queue);
+
+enum tx_push_result tx_queue_push(struct tx_queue *queue, struct tx_frame *tx_frame);
+
+struct tx_frame *tx_queue_peek(struct tx_queue *queue);
+
+void tx_queue_pop(struct tx_queue *queue);
+
+void tx_queue_clear(struct tx_queue *queue);
+
+#endif // TX_QUEUE_H
@@ -1,5 +1,6 @@
 defmodule NgCanTest do
   use ExUnit.Case
+  use Bitwise
   doctest Ng.Can
   require Logger
   #we can use the same interface if
@@ -59,6 +60,173 @@ defmodule NgCanTest do
     assert true
   end
 
+  test "write + read - threaded reader", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface, threaded: [ring_size: 256])
+    frames = Enum.map (1..100), fn i -> {i, <<1,2,3,4,5,6,7,i>>} end
+    :ok = Ng.Can.write(can1, frames)
+    recv_frames(can2, frames)
+    {:ok, stats} = Ng.Can.stats(can2)
+    assert stats.rx_ring_overflows == 0
+  end
+
+  test "coalesced frames are delivered when the timeout runs out", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface, coalesce: [frames: 500, timeout_us: 5000])
+    frames = Enum.map (1..10), fn i -> {i, <<1,2,3,4,5,6,7,i>>} end
+    Enum.each frames, &(:ok = Ng.Can.write(can1, &1))
+    recv_frames(can2, frames)
+    {:ok, stats} = Ng.Can.stats(can2)
+    assert stats.coalesce_timeouts > 0
+    assert stats.notifications < 10
+  end
+
+  test "stats count frames in both directions", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface)
+    frames = Enum.map (1..10), fn i -> {i, <<1,2,3,4,5,6,7,i>>} end
+    :ok = Ng.Can.write(can1, frames)
+    recv_frames(can2, frames)
+    {:ok, tx_stats} = Ng.Can.stats(can1)
+    {:ok, rx_stats} = Ng.Can.stats(can2)
+    assert tx_stats.tx_frames == 10
+    assert tx_stats.tx_bytes == 80
+    assert rx_stats.rx_frames == 10
+    assert rx_stats.rx_kernel_drops == 0
+    assert rx_stats.rcvbuf_drops == 0
+    assert Enum.sum(for {_bound, count} <- rx_stats.notify_batch_hist, do: count) ==
+      rx_stats.notifications
+  end
+
+  test "on_change only delivers changed payloads", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    #last byte is a rolling counter
+    :ok = Ng.Can.open(can2, @can2_interface, on_change: [masks: [{1, <<255,255,255,255,255,255,255,0>>}]])
+    frames = [{1, <<1,0,0,0,0,0,0,1>>}, {1, <<1,0,0,0,0,0,0,2>>},
+              {1, <<2,0,0,0,0,0,0,3>>}, {2, <<2,0,0,0,0,0,0,0>>},
+              {2, <<2,0,0,0,0,0,0,0>>}]
+    :ok = Ng.Can.write(can1, frames)
+    recv_frames(can2, [{1, <<1,0,0,0,0,0,0,1>>}, {1, <<2,0,0,0,0,0,0,3>>},
+                       {2, <<2,0,0,0,0,0,0,0>>}])
+    {:ok, stats} = Ng.Can.stats(can2)
+    assert stats.rx_suppressed == 2
+  end
+
+  test "on_change masks apply to extended ids", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface, on_change: [masks: [{0x18FEF100, <<255, 255, 255, 255, 255, 255, 255, 0>>}]])
+    id = 0x18FEF100 ||| 0x80000000
+    :ok = Ng.Can.write(can1, [{id, <<1,0,0,0,0,0,0,1>>}, {id, <<1,0,0,0,0,0,0,2>>}])
+    recv_frames(can2, [{id, <<1,0,0,0,0,0,0,1>>}])
+    {:ok, stats} = Ng.Can.stats(can2)
+    assert stats.rx_suppressed == 1
+    assert {:error, :einval} = Ng.Can.open(can2, @can2_interface,
+                                           on_change: [masks: [{0x123, :binary.copy(<<0xFF>>, 9)}]])
+  end
+
+  test "decimation can be changed without reopening", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface, decimate: [{1, every: 3}])
+    frames = Enum.map (1..6), fn i -> {1, <<0,0,0,0,0,0,0,i>>} end
+    :ok = Ng.Can.write(can1, frames)
+    recv_frames(can2, [{1, <<0,0,0,0,0,0,0,1>>}, {1, <<0,0,0,0,0,0,0,4>>}])
+
+    #latest wins inside a window
+    :ok = Ng.Can.set_decimation(can2, [{{0, 0}, window: 200}])
+    :ok = Ng.Can.write(can1, frames)
+    recv_frames(can2, [{1, <<0,0,0,0,0,0,0,1>>}, {1, <<0,0,0,0,0,0,0,6>>}])
+  end
+
+  test "malformed decimation rules are rejected", %{can1: can1} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    assert {:error, :einval} = Ng.Can.set_decimation(can1, [{1, every: 0}])
+    assert {:error, :einval} = Ng.Can.set_decimation(can1, [{1, every: 2, window: 10}])
+    assert {:error, :einval} = Ng.Can.open(can1, @can1_interface, decimate: [{1, []}])
+  end
+
+  test "full tx queues reject frames", %{can1: can1} do
+    :ok = Ng.Can.open(can1, @can1_interface, sndbuf: 1024,
+                      tx_queues: [normal: [depth: 10, policy: :reject]])
+    frames = Enum.map (1..500), fn i -> {0x700, <<0,0,0,0,0,0,i &&& 0xFF, i >>> 8>>} end
+    assert {:error, {:tx_queue_full, rejected}} = Ng.Can.write(can1, frames)
+    {:ok, stats} = Ng.Can.stats(can1)
+    assert stats.tx_rejected == rejected
+    assert {:error, :einval} = Ng.Can.write(can1, {1, <<1>>}, class: :urgent)
+    assert {:error, :einval} = Ng.Can.open(can1, @can1_interface, tx_queues: [bulk: [depth: 0]])
+    assert {:error, :einval} = Ng.Can.open(can1, @can1_interface, tx_queues: [high: [policy: :drop_newest]])
+  end
+
+  test ":high frames overtake queued :bulk frames", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface, sndbuf: 1024, tx_queues: [bulk: [depth: 1000]])
+    :ok = Ng.Can.open(can2, @can2_interface)
+    bulk = Enum.map (1..500), fn i -> {0x700, <<0,0,0,0,0,0,i &&& 0xFF, i >>> 8>>} end
+    :ok = Ng.Can.write(can1, bulk, class: :bulk)
+    :ok = Ng.Can.write(can1, {0x100, <<1>>}, class: :high)
+    received = collect_frames(can2, 501)
+    assert Enum.find_index(received, &(&1 == {0x100, <<1,0,0,0,0,0,0,0>>})) < 500
+  end
+
+  test "tx confirmations report when frames were sent", %{can1: can1} do
+    :ok = Ng.Can.open(can1, @can1_interface, tx_confirm: true)
+    :ok = Ng.Can.write(can1, [{1, <<1>>}, {2, <<2>>}], confirm: :batch)
+    assert_receive {:can_tx_confirmed, @can1_interface, :batch, ts} when is_integer(ts), 1000
+    :ok = Ng.Can.write(can1, [{1, <<1>>}, {2, <<2>>}], confirm: :frames, confirm_mode: :frame)
+    assert_receive {:can_tx_confirmed, _, {:frames, 0}, _}, 1000
+    assert_receive {:can_tx_confirmed, _, {:frames, 1}, _}, 1000
+  end
+
+  test "busy polling still delivers every frame", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface, realtime: [busy_poll_us: 200])
+    frames = Enum.map (1..50), fn i -> {i, <<1,2,3,4,5,6,7,i>>} end
+    :ok = Ng.Can.write(can1, frames)
+    recv_frames(can2, frames)
+    assert :ok = Ng.Can.set_realtime(can2, [])
+    assert {:error, :einval} = Ng.Can.set_realtime(can2, lock_memory: :yes)
+    assert {:error, :einval} = Ng.Can.set_realtime(can2, busy_poll_us: -5)
+    assert {:error, :einval} = Ng.Can.set_realtime(can2, priority: 100)
+    assert {:error, :einval} = Ng.Can.set_realtime(can2, cpu: "1")
+  end
+
+  test "flight recorder dumps frames around a trigger", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open(can1, @can1_interface)
+    :ok = Ng.Can.open(can2, @can2_interface,
+                      recorder: [pre_ms: 1000, post_ms: 50, triggers: [{:payload, 0x7FF, <<0xDE, 0xAD>>}]])
+    frames = Enum.map (1..5), fn i -> {i, <<1,2,3,4,5,6,7,i>>} end
+    :ok = Ng.Can.write(can1, frames ++ [{0x7FF, <<0xDE, 0xAD>>}, {6, <<6>>}])
+    assert_receive {:can_recording, @can2_interface, %{trigger: {:payload, 0x7FF}, frames: recorded}}, 1000
+    assert Enum.map(recorded, fn {_ts, id, _data} -> id end) == [1, 2, 3, 4, 5, 0x7FF, 6]
+    assert {:error, :einval} = Ng.Can.open(can1, @can1_interface,
+                                           recorder: [triggers: [{:payload, 0x7FF, :binary.copy(<<0>>, 9)}]])
+  end
+
+  test "j1939 delivers reassembled multi-packet messages", %{can1: can1, can2: can2} do
+    :ok = Ng.Can.open_j1939(can1, @can1_interface, address: 0x20)
+    :ok = Ng.Can.open_j1939(can2, @can2_interface, filters: [[pgn: 0xFEEC]])
+    #over 8 bytes, so it's broadcast with BAM
+    data = :binary.copy(<<0xAB>>, 20)
+    :ok = Ng.Can.write_j1939(can1, {0xFEEC, 0xFF, data})
+    :ok = Ng.Can.await_read(can2)
+    assert_receive {:j1939_messages, @can2_interface, [{0xFEEC, 0x20, 0xFF, 6, ^data}]}, 3000
+    assert {:error, :einval} = Ng.Can.write_j1939(can1, {0xFEEC, 0xFF, data, 8})
+    assert {:error, :einval} = Ng.Can.write_j1939(can1, {0x40000, 0xFF, data})
+    assert {:error, :einval} = Ng.Can.open_j1939(can2, @can2_interface, filters: [[pgn: :all]])
+  end
+
+  defp collect_frames(reader, count, recvd_frames \\ []) do
+    :ok = Ng.Can.await_read(reader)
+    receive do
+      {:can_frames, _, new_frames} ->
+        recvd_frames = recvd_frames ++ new_frames
+        if length(recvd_frames) >= count,
+          do: recvd_frames,
+          else: collect_frames(reader, count, recvd_frames)
+    after
+      3000 ->
+        raise "timed out waiting for frames"
+    end
+  end
+
   defp recv_frames(reader, sent_frames, recvd_frames \\ []) do
     :ok = Ng.Can.await_read(reader)
     receive do